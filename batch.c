@@ -0,0 +1,374 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+
+#if !defined(__GNUC__)
+#error "batch.c needs the GCC/Clang vector extensions"
+#endif
+
+// Machines covered by one vector op, a byte per machine
+#ifdef __AVX2__
+#define BATCH_LANES 32
+#else
+#define BATCH_LANES 16
+#endif
+
+// A byte of every machine in a group, one register wide. GCC turns ops
+// on these into AVX2 with -mavx2 (or -march=native), SSE2 otherwise.
+// Comparisons give 0xFF in lanes where they hold, which doubles as mask.
+typedef uint8_t Lanes __attribute__((vector_size(BATCH_LANES)));
+typedef int8_t LaneFlags __attribute__((vector_size(BATCH_LANES)));
+// Cycles left of every machine in a group
+typedef uint32_t LaneCounts __attribute__((vector_size(BATCH_LANES * 4)));
+typedef int32_t LaneWide __attribute__((vector_size(BATCH_LANES * 4)));
+
+// BATCH_LANES machines in structure of arrays form
+typedef struct {
+    Lanes pcPtr, tmpPcPtr, locPtr;
+    Lanes regX, regY, regZ;
+    Lanes useCarry, carry;
+    // JumpState after the last taken JMP and if ZTR ran since, the same
+    // fixed point check the engines in libpbpu.c do
+    Lanes jmpPc, lastTmp, lastLoc, lastX, lastY, lastZ, lastUseCarry, lastCarry;
+    Lanes stored;
+    // 0xFF in lanes that halted or hold no machine
+    Lanes halted;
+    // One nibble per byte, ram[addr] holds that nibble of every lane
+    Lanes ram[256];
+    uint64_t cycles[BATCH_LANES];
+} LaneGroup;
+
+struct Batch {
+    uint8_t rom[256];
+    int count;
+    int groupCount;
+    LaneGroup* groups;
+};
+
+// Cycles per RunGroup call, so lane counters fit 32 bits
+#define GROUP_CHUNK 0xFFFFFFFFu
+
+// Macros rather than functions, passing vectors around by value is
+// what the x86-64 ABI only agrees on with AVX enabled
+// new where mask is set, old elsewhere
+#define BLEND(mask, new, old) (((new) & (mask)) | ((old) & ~(mask)))
+// Every lane set to v
+#define SPLAT(v) ((Lanes){0} + (uint8_t)(v))
+// 0xFF lanes to 0xFFFFFFFF lanes and back
+#define WIDEN(mask) ((LaneCounts)__builtin_convertvector((LaneFlags)(mask), LaneWide))
+#define NARROW(mask) ((Lanes)__builtin_convertvector((LaneWide)(mask), LaneFlags))
+
+static inline bool Any(const Lanes* v) {
+    uint64_t words[BATCH_LANES / 8];
+    memcpy(words, v, sizeof(words));
+    uint64_t any = 0;
+    for (int i = 0; i < BATCH_LANES / 8; i++)
+        any |= words[i];
+    return any != 0;
+}
+#define ANY(v) ({ Lanes anyOf = (v); Any(&anyOf); })
+
+static inline uint8_t MinLane(const Lanes* v) {
+    uint8_t min = 0xFF;
+    for (int i = 0; i < BATCH_LANES; i++)
+        min = (*v)[i] < min ? (*v)[i] : min;
+    return min;
+}
+#define MIN_LANE(v) ({ Lanes minOf = (v); MinLane(&minOf); })
+
+// Lowest count among the lanes in mask
+static inline uint32_t MinCount(const LaneCounts* counts, const Lanes* mask) {
+    uint32_t min = UINT32_MAX;
+    for (int i = 0; i < BATCH_LANES; i++)
+        min = (*mask)[i] && (*counts)[i] < min ? (*counts)[i] : min;
+    return min;
+}
+
+// The ram nibble at locPtr for the lanes in mask. One row serves all of
+// them when they agree on the address, as they usually do.
+static inline void ReadRam(const Lanes* ram, const Lanes* locPtr, const Lanes* mask, Lanes* val) {
+    uint8_t addr = MIN_LANE(*locPtr | ~*mask);
+    if (!ANY(*mask & (Lanes)(*locPtr != addr))) {
+        *val = BLEND(*mask, ram[addr], *val);
+        return;
+    }
+    for (int i = 0; i < BATCH_LANES; i++) {
+        if ((*mask)[i])
+            (*val)[i] = ram[(*locPtr)[i]][i];
+    }
+}
+
+static inline void WriteRam(Lanes* ram, const Lanes* locPtr, const Lanes* mask, const Lanes* val) {
+    uint8_t addr = MIN_LANE(*locPtr | ~*mask);
+    if (!ANY(*mask & (Lanes)(*locPtr != addr))) {
+        ram[addr] = BLEND(*mask, *val, ram[addr]);
+        return;
+    }
+    for (int i = 0; i < BATCH_LANES; i++) {
+        if ((*mask)[i])
+            ram[(*locPtr)[i]][i] = (*val)[i];
+    }
+}
+
+// Run the lanes of g up to budget steps each. Every step executes the
+// instruction at the lowest pc among the running lanes, in all lanes
+// sitting at that pc. Lanes elsewhere are masked out and catch up when
+// their pc comes around, lanes running the same loop stay in step.
+// While all of them are at one pc it is kept as a scalar and the lanes
+// share one step counter, only a JMP that splits them or a lane
+// running out of budget brings the vectors up to date.
+static void RunGroup(const uint8_t* rom, LaneGroup* g, uint32_t budget) {
+    Lanes* ram = g->ram;
+    Lanes pcPtr = g->pcPtr, tmpPcPtr = g->tmpPcPtr, locPtr = g->locPtr;
+    Lanes regX = g->regX, regY = g->regY, regZ = g->regZ;
+    Lanes useCarry = g->useCarry, carry = g->carry, stored = g->stored;
+    Lanes halted = g->halted;
+    // Lanes with budget left
+    Lanes running = budget ? ~halted : SPLAT(0);
+    LaneCounts start = WIDEN(running) & budget;
+    LaneCounts left = start;
+    // Steps all running lanes took that left doesn't count yet, and the
+    // lowest left among them
+    uint32_t shared = 0;
+    uint32_t minLeft = budget;
+    // If all running lanes are at pc
+    uint8_t pc = MIN_LANE(pcPtr | ~running);
+    bool together = !ANY(running & (Lanes)(pcPtr != pc));
+
+    while (ANY(running)) {
+        Lanes active = running;
+        if (!together) {
+            pc = MIN_LANE(pcPtr | ~running);
+            active &= (Lanes)(pcPtr == pc);
+        }
+        uint8_t op = rom[pc] >> 4;
+        uint8_t imm = rom[pc] & 0xF;
+        Lanes taken = SPLAT(0), halt = SPLAT(0);
+        // If any lane jumps, if any lane halts
+        bool jumped = false, halting = false;
+
+        switch (op) {
+            case OP_NOP:
+                break;
+            case OP_ADD: {
+                Lanes aluOut = regX + regY + (useCarry & carry);
+                regZ = BLEND(active, aluOut & 0xF, regZ);
+                carry = BLEND(active, aluOut >> 4, carry);
+                break;
+            }
+            case OP_SUB: {
+                Lanes subTmp = regY + (useCarry & carry);
+                regZ = BLEND(active, (regX - subTmp) & 0xF, regZ);
+                carry = BLEND(active, (Lanes)(regX >= subTmp) & 1, carry);
+                break;
+            }
+            case OP_WT1:
+                locPtr = BLEND(active, (locPtr & 0x0F) | (uint8_t)(imm << 4), locPtr);
+                break;
+            case OP_WT2:
+                locPtr = BLEND(active, (locPtr & 0xF0) | imm, locPtr);
+                break;
+            case OP_WTX:
+                regX = BLEND(active, SPLAT(imm), regX);
+                break;
+            case OP_WTY:
+                regY = BLEND(active, SPLAT(imm), regY);
+                break;
+            case OP_WTZ:
+                regZ = BLEND(active, SPLAT(imm), regZ);
+                break;
+            case OP_ZTR:
+                WriteRam(ram, &locPtr, &active, &regZ);
+                stored |= active;
+                break;
+            case OP_RTZ:
+                ReadRam(ram, &locPtr, &active, &regZ);
+                break;
+            case OP_PC1:
+                tmpPcPtr = BLEND(active, (tmpPcPtr & 0xF0) | imm, tmpPcPtr);
+                break;
+            case OP_PC2:
+                tmpPcPtr = BLEND(active, (tmpPcPtr & 0x0F) | (uint8_t)(imm << 4), tmpPcPtr);
+                break;
+            case OP_JMP: {
+                // Only perform JMP if Z is 0, masked per lane
+                taken = active & (Lanes)(regZ == 0);
+                jumped = ANY(taken);
+                if (!jumped)
+                    break;
+                // The fixed point check of JumpHalts in libpbpu.c
+                Lanes self = taken & (Lanes)(tmpPcPtr == pc);
+                Lanes again = taken & ~self & ~stored & (Lanes)(g->jmpPc == pc)
+                    & (Lanes)(g->lastTmp == tmpPcPtr) & (Lanes)(g->lastLoc == locPtr)
+                    & (Lanes)(g->lastX == regX) & (Lanes)(g->lastY == regY)
+                    & (Lanes)(g->lastZ == regZ) & (Lanes)(g->lastUseCarry == useCarry)
+                    & (Lanes)(g->lastCarry == carry);
+                Lanes update = taken & ~self;
+                g->jmpPc = BLEND(update, SPLAT(pc), g->jmpPc);
+                g->lastTmp = BLEND(update, tmpPcPtr, g->lastTmp);
+                g->lastLoc = BLEND(update, locPtr, g->lastLoc);
+                g->lastX = BLEND(update, regX, g->lastX);
+                g->lastY = BLEND(update, regY, g->lastY);
+                g->lastZ = BLEND(update, regZ, g->lastZ);
+                g->lastUseCarry = BLEND(update, useCarry, g->lastUseCarry);
+                g->lastCarry = BLEND(update, carry, g->lastCarry);
+                stored &= ~update;
+                halt = self | again;
+                halting = ANY(halt);
+                break;
+            }
+            case OP_RTX:
+                ReadRam(ram, &locPtr, &active, &regX);
+                break;
+            case OP_RTY:
+                ReadRam(ram, &locPtr, &active, &regY);
+                break;
+            case OP_USC:
+                useCarry ^= active & 1;
+                break;
+        }
+
+        if (together && !halting) {
+            // Still together if every lane jumps or none does, to one target
+            if (!jumped) {
+                pc++;
+            } else {
+                uint8_t target = MIN_LANE(tmpPcPtr | ~taken);
+                if (ANY((running & ~taken) | (taken & (Lanes)(tmpPcPtr != target))))
+                    goto split;
+                pc = target;
+            }
+            if (++shared < minLeft)
+                continue;
+            pcPtr = BLEND(running, SPLAT(pc), pcPtr);
+            goto sync;
+        }
+
+split:
+        if (together)
+            pcPtr = BLEND(running, SPLAT(pc), pcPtr);
+        pcPtr = BLEND(active, BLEND(taken, tmpPcPtr, SPLAT(pc + 1)), pcPtr);
+        // active lanes are -1 when widened, that takes one cycle off
+        left += WIDEN(active);
+        if (halting) {
+            // A halting lane still spent this cycle, count what it ran
+            // and take it out
+            halted |= halt;
+            left -= WIDEN(running) & shared;
+            shared = 0;
+            for (int i = 0; i < BATCH_LANES; i++) {
+                if (halt[i]) {
+                    g->cycles[i] += start[i] - left[i];
+                    start[i] = left[i] = 0;
+                }
+            }
+        }
+sync:
+        left -= WIDEN(running) & shared;
+        shared = 0;
+        running &= NARROW((LaneCounts)(left != 0));
+        minLeft = MinCount(&left, &running);
+        pc = MIN_LANE(pcPtr | ~running);
+        together = !ANY(running & (Lanes)(pcPtr != pc));
+    }
+
+    g->pcPtr = pcPtr;
+    g->tmpPcPtr = tmpPcPtr;
+    g->locPtr = locPtr;
+    g->regX = regX;
+    g->regY = regY;
+    g->regZ = regZ;
+    g->useCarry = useCarry;
+    g->carry = carry;
+    g->stored = stored;
+    g->halted = halted;
+    for (int i = 0; i < BATCH_LANES; i++)
+        g->cycles[i] += start[i] - left[i];
+}
+
+Batch* CreateBatch(int count) {
+    if (count <= 0)
+        return NULL;
+    Batch* b = calloc(1, sizeof(Batch));
+    if (b == NULL)
+        return NULL;
+    b->count = count;
+    b->groupCount = (count + BATCH_LANES - 1) / BATCH_LANES;
+    size_t size = b->groupCount * sizeof(LaneGroup);
+    b->groups = aligned_alloc(sizeof(Lanes), size);
+    if (b->groups == NULL) {
+        free(b);
+        return NULL;
+    }
+    memset(b->groups, 0, size);
+    // Lanes past count never run
+    for (int lane = count; lane < b->groupCount * BATCH_LANES; lane++)
+        b->groups[lane / BATCH_LANES].halted[lane % BATCH_LANES] = 0xFF;
+    return b;
+}
+
+void DestroyBatch(Batch* b) {
+    free(b->groups);
+    free(b);
+}
+
+// Registers are masked like SetState does
+void BatchSetState(Batch* b, int lane, const MachineState* state) {
+    LaneGroup* g = &b->groups[lane / BATCH_LANES];
+    int i = lane % BATCH_LANES;
+    memcpy(b->rom, state->rom, sizeof(b->rom));
+    for (int addr = 0; addr < 256; addr++)
+        g->ram[addr][i] = addr % 2 ? state->ram[addr / 2] >> 4 : state->ram[addr / 2] & 0xF;
+    g->pcPtr[i] = state->pcPtr;
+    g->tmpPcPtr[i] = state->tmpPcPtr;
+    g->locPtr[i] = state->locPtr;
+    g->regX[i] = state->regX & 0xF;
+    g->regY[i] = state->regY & 0xF;
+    g->regZ[i] = state->regZ & 0xF;
+    g->useCarry[i] = state->useCarry;
+    g->carry[i] = state->carry;
+    g->cycles[i] = state->cycles;
+    g->jmpPc[i] = g->lastTmp[i] = g->lastLoc[i] = 0;
+    g->lastX[i] = g->lastY[i] = g->lastZ[i] = 0;
+    g->lastUseCarry[i] = g->lastCarry[i] = 0;
+    g->stored[i] = 0;
+    g->halted[i] = 0;
+}
+
+void BatchGetState(const Batch* b, int lane, MachineState* state) {
+    const LaneGroup* g = &b->groups[lane / BATCH_LANES];
+    int i = lane % BATCH_LANES;
+    memcpy(state->rom, b->rom, sizeof(state->rom));
+    for (int addr = 0; addr < 256; addr += 2)
+        state->ram[addr / 2] = g->ram[addr][i] | g->ram[addr + 1][i] << 4;
+    state->pcPtr = g->pcPtr[i];
+    state->tmpPcPtr = g->tmpPcPtr[i];
+    state->locPtr = g->locPtr[i];
+    state->regX = g->regX[i];
+    state->regY = g->regY[i];
+    state->regZ = g->regZ[i];
+    state->useCarry = g->useCarry[i];
+    state->carry = g->carry[i];
+    state->cycles = g->cycles[i];
+}
+
+void BatchRun(Batch* b, uint64_t maxCycles) {
+    // Like SimRun, a halted machine goes on when run again
+    for (int lane = 0; lane < b->count; lane++)
+        b->groups[lane / BATCH_LANES].halted[lane % BATCH_LANES] = 0;
+    for (int group = 0; group < b->groupCount; group++) {
+        LaneGroup* g = &b->groups[group];
+        for (uint64_t done = 0; done < maxCycles && ANY(~g->halted);) {
+            uint32_t chunk = maxCycles - done < GROUP_CHUNK ? maxCycles - done : GROUP_CHUNK;
+            RunGroup(b->rom, g, chunk);
+            done += chunk;
+        }
+    }
+}
+
+bool BatchHalted(const Batch* b, int lane) {
+    return b->groups[lane / BATCH_LANES].halted[lane % BATCH_LANES] != 0;
+}
@@ -0,0 +1,28 @@
+#ifndef PBPU_BATCH_H
+#define PBPU_BATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libpbpu.h"
+
+// Many machines running one rom in lockstep, see batch.c
+typedef struct Batch Batch;
+
+// Allocate count machines in their power-on state, NULL on failure
+Batch* CreateBatch(int count);
+// Free a batch from CreateBatch
+void DestroyBatch(Batch* b);
+
+// Replace the state of one machine. All machines share one rom, the
+// rom of the last state set is the one that runs.
+void BatchSetState(Batch* b, int lane, const MachineState* state);
+// Copy the state of one machine out
+void BatchGetState(const Batch* b, int lane, MachineState* state);
+// Run every machine up to maxCycles steps, each stops on its own
+// when it halts like SimRun would
+void BatchRun(Batch* b, uint64_t maxCycles);
+// If a machine halted during the last BatchRun
+bool BatchHalted(const Batch* b, int lane);
+
+#endif
@@ -0,0 +1,345 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "emitc.h"
+#include "pbpu_internal.h"
+
+// What is known about tmpPcPtr when reaching an address
+typedef struct {
+    bool reached;
+    // Bits of tmpPcPtr that are the same on every path
+    uint8_t known;
+    uint8_t value;
+} TmpInfo;
+
+// Result of the control flow analysis
+typedef struct {
+    TmpInfo tmp[256];
+    // Addresses control can arrive at other than from the previous one,
+    // each gets a label and a budget check
+    bool leader[256];
+    // If some JMP target couldn't be resolved
+    bool dynamic;
+} Analysis;
+
+// Merge one more path into an address, true if that taught us something new
+static bool Merge(TmpInfo* info, uint8_t known, uint8_t value) {
+    value &= known;
+    if (!info->reached) {
+        info->reached = true;
+        info->known = known;
+        info->value = value;
+        return true;
+    }
+    uint8_t newKnown = info->known & known & ~(info->value ^ value);
+    if (newKnown == info->known)
+        return false;
+    info->known = newKnown;
+    info->value &= newKnown;
+    return true;
+}
+
+// Follow every path from reset and track which bits of tmpPcPtr are
+// fixed, JMPs whose target comes out fully known become gotos
+static void Analyse(const Machine* m, Analysis* a) {
+    uint8_t work[256];
+    bool queued[256] = {false};
+    int workCount = 0;
+
+    *a = (Analysis){0};
+    // Reset state
+    Merge(&a->tmp[0], 0xFF, 0x00);
+    a->leader[0] = true;
+    work[workCount++] = 0;
+    queued[0] = true;
+
+#define PUSH(addr, k, v) \
+    if (Merge(&a->tmp[addr], k, v) && !queued[addr]) { \
+        work[workCount++] = addr; \
+        queued[addr] = true; \
+    }
+
+    while (workCount > 0) {
+        uint8_t addr = work[--workCount];
+        queued[addr] = false;
+        uint8_t known = a->tmp[addr].known;
+        uint8_t value = a->tmp[addr].value;
+        uint8_t imm = m->code[addr].imm;
+
+        switch(m->code[addr].op) {
+            case OP_PC1:
+                known |= 0x0F;
+                value = (value & 0xF0) | imm;
+                break;
+            case OP_PC2:
+                known |= 0xF0;
+                value = (value & 0x0F) | (imm << 4);
+                break;
+            case OP_JMP:
+                // Falls through when Z isn't 0
+                a->leader[(uint8_t)(addr + 1)] = true;
+                if (known == 0xFF) {
+                    a->leader[value] = true;
+                    PUSH(value, known, value);
+                } else {
+                    a->dynamic = true;
+                    for (int target = 0; target < 256; target++)
+                        PUSH(target, known, value);
+                }
+                break;
+        }
+        uint8_t next = addr + 1;
+        PUSH(next, known, value);
+    }
+#undef PUSH
+
+    // Any address may be jumped to
+    if (a->dynamic) {
+        for (int addr = 0; addr < 256; addr++)
+            a->leader[addr] = true;
+    }
+}
+
+// Instructions from a leader up to its JMP or the next leader
+static int SegmentLength(const Machine* m, const Analysis* a, uint8_t start) {
+    int length = 0;
+    for (int addr = start; addr < 256; addr++) {
+        if (addr != start && a->leader[addr])
+            break;
+        length++;
+        if (m->code[addr].op == OP_JMP)
+            break;
+    }
+    return length;
+}
+
+// C for one instruction
+static void EmitInstruction(const Machine* m, const Analysis* a, uint8_t addr, FILE* out) {
+    uint8_t imm = m->code[addr].imm;
+    fprintf(out, "    // %02X: %s %01X\n", addr, OpCodeName(m->code[addr].op), imm);
+    switch(m->code[addr].op) {
+        case OP_NOP:
+            break;
+        case OP_ADD:
+            fprintf(out, "    regZ = regX + regY + (useCarry & carry);\n");
+            fprintf(out, "    carry = (regZ >> 4) & 0x1;\n");
+            fprintf(out, "    regZ &= 0xF;\n");
+            break;
+        case OP_SUB:
+            fprintf(out, "    subTmp = regY + (useCarry & carry);\n");
+            fprintf(out, "    carry = regX >= subTmp;\n");
+            fprintf(out, "    regZ = (regX - subTmp) & 0xF;\n");
+            break;
+        case OP_WT1:
+            fprintf(out, "    locPtr = (locPtr & 0x0F) | 0x%02X;\n", imm << 4);
+            break;
+        case OP_WT2:
+            fprintf(out, "    locPtr = (locPtr & 0xF0) | 0x%02X;\n", imm);
+            break;
+        case OP_WTX:
+            fprintf(out, "    regX = 0x%X;\n", imm);
+            break;
+        case OP_WTY:
+            fprintf(out, "    regY = 0x%X;\n", imm);
+            break;
+        case OP_WTZ:
+            fprintf(out, "    regZ = 0x%X;\n", imm);
+            break;
+        case OP_ZTR:
+            fprintf(out, "    RAM_WRITE(locPtr, regZ);\n");
+            fprintf(out, "    ramDirty = stored = 1;\n");
+            fprintf(out, "    screenDirty |= locPtr < 4;\n");
+            break;
+        case OP_RTZ:
+            fprintf(out, "    regZ = RAM_READ(locPtr);\n");
+            break;
+        case OP_PC1:
+            fprintf(out, "    tmpPcPtr = (tmpPcPtr & 0xF0) | 0x%02X;\n", imm);
+            break;
+        case OP_PC2:
+            fprintf(out, "    tmpPcPtr = (tmpPcPtr & 0x0F) | 0x%02X;\n", imm << 4);
+            break;
+        case OP_JMP: {
+            const TmpInfo* info = &a->tmp[addr];
+            if (info->known != 0xFF) {
+                fprintf(out, "    if (regZ == 0) {\n");
+                fprintf(out, "        pcPtr = tmpPcPtr;\n");
+                fprintf(out, "        if (pcPtr == 0x%02X || SAME_JUMP(0x%02X)) goto halt;\n", addr, addr);
+                fprintf(out, "        SET_JUMP(0x%02X);\n", addr);
+                fprintf(out, "        goto dispatch;\n");
+                fprintf(out, "    }\n");
+            } else if (info->value == addr) {
+                // A JMP onto itself can never change state again
+                fprintf(out, "    if (regZ == 0) { pcPtr = 0x%02X; goto halt; }\n", addr);
+            } else {
+                fprintf(out, "    if (regZ == 0) {\n");
+                fprintf(out, "        if (SAME_JUMP(0x%02X)) { pcPtr = 0x%02X; goto halt; }\n", addr, info->value);
+                fprintf(out, "        SET_JUMP(0x%02X);\n", addr);
+                fprintf(out, "        goto a%02X;\n", info->value);
+                fprintf(out, "    }\n");
+            }
+            break;
+        }
+        case OP_RTX:
+            fprintf(out, "    regX = RAM_READ(locPtr);\n");
+            break;
+        case OP_RTY:
+            fprintf(out, "    regY = RAM_READ(locPtr);\n");
+            break;
+        case OP_USC:
+            fprintf(out, "    useCarry = !useCarry;\n");
+            break;
+    }
+}
+
+bool EmitC(const Machine* m, const char* source, FILE* out) {
+    Analysis a;
+    Analyse(m, &a);
+
+    fprintf(out, "// Generated by pbpu --emit-c from %s\n", source);
+    fprintf(out, "// Build: gcc <this file> libpbpu.c jit.c -I<pbpu dir> -O3\n");
+    fprintf(out, "#include <stdint.h>\n#include <stdio.h>\n#include <string.h>\n#include <time.h>\n\n");
+    fprintf(out, "#include \"pbpu_internal.h\"\n\n");
+
+    // The state m is in, reset or loaded with --load-state
+    fprintf(out, "static const MachineState start = {\n");
+    fprintf(out, "    .rom = {");
+    for (int addr = 0; addr < 256; addr++)
+        fprintf(out, "%s0x%02X,", addr % 16 == 0 ? "\n        " : " ", m->rom[addr]);
+    fprintf(out, "\n    },\n");
+    fprintf(out, "    .ram = {");
+    for (int i = 0; i < 128; i++)
+        fprintf(out, "%s0x%02X,", i % 16 == 0 ? "\n        " : " ", m->ram[i]);
+    fprintf(out, "\n    },\n");
+    fprintf(out, "    .pcPtr = 0x%02X, .tmpPcPtr = 0x%02X, .locPtr = 0x%02X,\n",
+        m->pcPtr, m->tmpPcPtr, m->locPtr);
+    fprintf(out, "    .regX = %d, .regY = %d, .regZ = %d, .useCarry = %d, .carry = %d,\n",
+        m->regX, m->regY, m->regZ, m->useCarry, m->carry);
+    fprintf(out, "    .cycles = %lluULL\n", (unsigned long long)m->cycles);
+    fprintf(out, "};\n");
+    const JumpState* j = &m->lastJump;
+    fprintf(out, "static const JumpState startJump = { 0x%02X, 0x%02X, 0x%02X, %d, %d, %d, %d, %d };\n",
+        j->jmpPc, j->tmpPcPtr, j->locPtr, j->regX, j->regY, j->regZ, j->useCarry, j->carry);
+    fprintf(out, "static const uint8_t startStored = %d;\n\n", m->storedSinceJump);
+
+    fprintf(out, "#define RAM_READ(addr) ((addr) & 1 ? ram[(addr) >> 1] >> 4 : ram[(addr) >> 1] & 0x0F)\n");
+    fprintf(out, "#define RAM_WRITE(addr, val) (ram[(addr) >> 1] = (addr) & 1 ? \\\n");
+    fprintf(out, "    (ram[(addr) >> 1] & 0x0F) | ((val) << 4) : (ram[(addr) >> 1] & 0xF0) | (val))\n\n");
+
+    fprintf(out, "// Fixed points are found the same way as JumpHalts in libpbpu.c\n");
+    fprintf(out, "#define SAME_JUMP(pc) (!stored && lastJump.jmpPc == (pc) && lastJump.tmpPcPtr == tmpPcPtr \\\n");
+    fprintf(out, "    && lastJump.locPtr == locPtr && lastJump.regX == regX && lastJump.regY == regY \\\n");
+    fprintf(out, "    && lastJump.regZ == regZ && lastJump.useCarry == useCarry && lastJump.carry == carry)\n");
+    fprintf(out, "#define SET_JUMP(pc) (lastJump = (JumpState){ (pc), tmpPcPtr, locPtr, regX, regY, regZ, \\\n");
+    fprintf(out, "    useCarry, carry }, stored = 0)\n\n");
+
+    fprintf(out, "// Runs like SimRun, budgets that end inside a block are finished by it\n");
+    if (a.dynamic) {
+        // Every address is a jump target then, value range propagation
+        // takes minutes on that many edges in GCC
+        fprintf(out, "#if defined(__GNUC__) && !defined(__clang__)\n");
+        fprintf(out, "__attribute__((optimize(\"no-tree-vrp\")))\n");
+        fprintf(out, "#endif\n");
+    }
+    fprintf(out, "static StopReason RunCompiled(Machine* m, uint64_t maxCycles) {\n");
+    fprintf(out, "    uint8_t* ram = m->ram;\n");
+    fprintf(out, "    uint8_t pcPtr = m->pcPtr, tmpPcPtr = m->tmpPcPtr, locPtr = m->locPtr;\n");
+    fprintf(out, "    uint8_t regX = m->regX, regY = m->regY, regZ = m->regZ;\n");
+    fprintf(out, "    uint8_t useCarry = m->useCarry, carry = m->carry, subTmp;\n");
+    fprintf(out, "    uint8_t ramDirty = 0, screenDirty = 0, halted = 0;\n");
+    fprintf(out, "    JumpState lastJump = m->lastJump;\n");
+    fprintf(out, "    uint8_t stored = m->storedSinceJump;\n");
+    fprintf(out, "    uint64_t left = maxCycles;\n\n");
+
+    // Entry only where the analysis holds for the current tmpPcPtr
+    fprintf(out, "    switch(pcPtr) {\n");
+    for (int addr = 0; addr < 256; addr++) {
+        if (!a.leader[addr] || !a.tmp[addr].reached)
+            continue;
+        if (a.tmp[addr].known == 0)
+            fprintf(out, "        case 0x%02X: goto a%02X;\n", addr, addr);
+        else
+            fprintf(out, "        case 0x%02X: if ((tmpPcPtr & 0x%02X) == 0x%02X) goto a%02X; break;\n",
+                addr, a.tmp[addr].known, a.tmp[addr].value, addr);
+    }
+    fprintf(out, "    }\n");
+    fprintf(out, "    goto leave;\n\n");
+
+    if (a.dynamic) {
+        // Targets of unresolved JMPs, the analysis covers them already
+        fprintf(out, "dispatch:\n");
+        fprintf(out, "    switch(pcPtr) {\n");
+        for (int addr = 0; addr < 256; addr++) {
+            if (a.tmp[addr].reached)
+                fprintf(out, "        case 0x%02X: goto a%02X;\n", addr, addr);
+        }
+        fprintf(out, "    }\n");
+        fprintf(out, "    goto leave;\n\n");
+    }
+
+    for (int addr = 0; addr < 256; addr++) {
+        if (!a.tmp[addr].reached)
+            continue;
+        if (a.leader[addr]) {
+            int length = SegmentLength(m, &a, addr);
+            fprintf(out, "a%02X:\n", addr);
+            fprintf(out, "    if (left < %d) { pcPtr = 0x%02X; goto leave; }\n", length, addr);
+            fprintf(out, "    left -= %d;\n", length);
+        }
+        EmitInstruction(m, &a, addr, out);
+    }
+    // Falling off the end of rom wraps around
+    fprintf(out, "    goto a00;\n\n");
+
+    fprintf(out, "halt:\n");
+    fprintf(out, "    halted = 1;\n");
+    fprintf(out, "leave:\n");
+    fprintf(out, "    m->pcPtr = pcPtr;\n");
+    fprintf(out, "    m->tmpPcPtr = tmpPcPtr;\n");
+    fprintf(out, "    m->locPtr = locPtr;\n");
+    fprintf(out, "    m->regX = regX;\n");
+    fprintf(out, "    m->regY = regY;\n");
+    fprintf(out, "    m->regZ = regZ;\n");
+    fprintf(out, "    m->useCarry = useCarry;\n");
+    fprintf(out, "    m->carry = carry;\n");
+    fprintf(out, "    m->lastJump = lastJump;\n");
+    fprintf(out, "    m->storedSinceJump = stored;\n");
+    fprintf(out, "    m->cycles += maxCycles - left;\n");
+    fprintf(out, "    m->ramDirty |= ramDirty;\n");
+    fprintf(out, "    m->screenDirty |= screenDirty;\n");
+    fprintf(out, "    return halted ? STOP_HALT : SimRun(m, left);\n");
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "int main(int argc, char** argv) {\n");
+    fprintf(out, "    uint64_t maxCycles = 1000000;\n");
+    fprintf(out, "    int bench = 0;\n");
+    fprintf(out, "    for (int i = 1; i < argc; i++) {\n");
+    fprintf(out, "        if (strncmp(argv[i], \"--cycles=\", 9) == 0)\n");
+    fprintf(out, "            sscanf(argv[i] + 9, \"%%llu\", (unsigned long long*)&maxCycles);\n");
+    fprintf(out, "        if (strcmp(argv[i], \"--bench\") == 0)\n");
+    fprintf(out, "            bench = 1;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    Machine* m = CreateMachine();\n");
+    fprintf(out, "    if (m == NULL)\n");
+    fprintf(out, "        return 1;\n");
+    fprintf(out, "    SetState(m, &start);\n");
+    fprintf(out, "    m->lastJump = startJump;\n");
+    fprintf(out, "    m->storedSinceJump = startStored;\n");
+    fprintf(out, "    struct timespec begin, end;\n");
+    fprintf(out, "    clock_gettime(CLOCK_MONOTONIC, &begin);\n");
+    fprintf(out, "    StopReason reason = RunCompiled(m, maxCycles);\n");
+    fprintf(out, "    clock_gettime(CLOCK_MONOTONIC, &end);\n");
+    fprintf(out, "    PrintState(m, reason, stdout);\n");
+    fprintf(out, "    if (bench) {\n");
+    fprintf(out, "        double secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;\n");
+    fprintf(out, "        uint64_t ran = m->cycles - start.cycles;\n");
+    fprintf(out, "        printf(\"Time: %%.3f s, %%.2f ns/instruction, %%.1f MIPS\\n\",\n");
+    fprintf(out, "            secs, secs * 1e9 / ran, ran / secs / 1e6);\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    DestroyMachine(m);\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+
+    return !ferror(out);
+}
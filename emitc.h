@@ -0,0 +1,16 @@
+#ifndef PBPU_EMITC_H
+#define PBPU_EMITC_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "libpbpu.h"
+
+// Write the program in rom as a C translation unit that runs it from
+// the state m is in, halt detection included. It links against libpbpu
+// and prints the same final state as --headless. source names the rom
+// in the generated comments.
+// Returns false if writing failed.
+bool EmitC(const Machine* m, const char* source, FILE* out);
+
+#endif
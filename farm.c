@@ -0,0 +1,306 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpbpu.h"
+#include "loop.h"
+#include "statefile.h"
+
+// Runs many programs headless on all cores, see the README
+
+// Cycle budget of programs without one in the manifest
+uint64_t maxCycles = 1000000;
+// Worker threads, 0 uses one per core
+int threadCount = 0;
+// Execution engine
+Engine engine = ENGINE_BLOCKS;
+// Skip whole passes through loops
+bool skipLoops = false;
+
+// One program to run and what came out
+typedef struct {
+    char* path;
+    uint64_t cycles;
+    // Result record, filled in by the worker that ran it
+    char* record;
+    size_t recordSize;
+} Job;
+
+Job* jobs = NULL;
+int jobCount = 0;
+
+// Jobs a worker hasn't started yet, the range [front, back) of jobs.
+// The owner takes from the back, thieves take half from the front.
+typedef struct {
+    pthread_mutex_t lock;
+    int front, back;
+} JobQueue;
+
+JobQueue* queues = NULL;
+
+bool AddJob(const char* path, uint64_t cycles) {
+    Job* grown = realloc(jobs, (jobCount + 1) * sizeof(Job));
+    if (grown == NULL)
+        return false;
+    jobs = grown;
+    jobs[jobCount].path = strdup(path);
+    jobs[jobCount].cycles = cycles;
+    jobs[jobCount].record = NULL;
+    jobs[jobCount].recordSize = 0;
+    if (jobs[jobCount].path == NULL)
+        return false;
+    jobCount++;
+    return true;
+}
+
+int ComparePaths(const void* a, const void* b) {
+    return strcmp(((const Job*)a)->path, ((const Job*)b)->path);
+}
+
+// Every regular file in dir, by name so records come out in a fixed order
+bool AddDirectory(const char* dir) {
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return false;
+    struct dirent* entry;
+    bool ok = true;
+    while (ok && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        struct stat info;
+        if (stat(path, &info) == 0 && S_ISREG(info.st_mode))
+            ok = AddJob(path, maxCycles);
+    }
+    closedir(d);
+    qsort(jobs, jobCount, sizeof(Job), ComparePaths);
+    return ok;
+}
+
+// One program per line, "path [cycles]". Relative paths start at the
+// manifest's directory, # starts a comment.
+bool AddManifest(const char* manifest) {
+    FILE* f = fopen(manifest, "r");
+    if (f == NULL)
+        return false;
+    const char* slash = strrchr(manifest, '/');
+    int dirLength = slash != NULL ? (int)(slash - manifest) + 1 : 0;
+    char line[4096];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f) != NULL) {
+        char* comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        char name[2048];
+        unsigned long long cycles = maxCycles;
+        int fields = sscanf(line, "%2047s %llu", name, &cycles);
+        if (fields <= 0)
+            continue;
+        char path[4096];
+        if (name[0] == '/')
+            snprintf(path, sizeof(path), "%s", name);
+        else
+            snprintf(path, sizeof(path), "%.*s%s", dirLength, manifest, name);
+        ok = AddJob(path, cycles);
+    }
+    fclose(f);
+    return ok;
+}
+
+// Run one program and write its record
+void RunJob(Job* job) {
+    FILE* out = open_memstream(&job->record, &job->recordSize);
+    if (out == NULL)
+        return;
+    fprintf(out, "ROM: %s\n", job->path);
+    Machine* m = CreateMachine();
+    if (m == NULL) {
+        fprintf(out, "Error: out of memory\n");
+        fclose(out);
+        return;
+    }
+    // Saved states start where they left off, anything else is a program
+    SavedMachine saved;
+    StateFileResult result = LoadStateFile(&saved, job->path);
+    long readBytes = 1;
+    if (result == STATE_OK)
+        RestoreMachine(m, &saved);
+    else if (result != STATE_VERSION)
+        readBytes = LoadRomFile(m, job->path);
+    if (result == STATE_VERSION) {
+        fprintf(out, "Error: %s\n", StateFileResultName(result));
+    } else if (readBytes < 0) {
+        fprintf(out, "Error: program not found\n");
+    } else if (readBytes == 0) {
+        fprintf(out, "Error: program is empty\n");
+    } else {
+        SetEngine(m, engine);
+        LoopInfo loop;
+        StopReason reason = skipLoops ? RunSkipLoops(m, job->cycles, &loop) : SimRun(m, job->cycles);
+        PrintState(m, reason, out);
+    }
+    DestroyMachine(m);
+    fclose(out);
+}
+
+// Next job for worker self, from its own queue or stolen. -1 once
+// there is no work left anywhere.
+int TakeJob(int self) {
+    JobQueue* own = &queues[self];
+    pthread_mutex_lock(&own->lock);
+    int job = own->front < own->back ? --own->back : -1;
+    pthread_mutex_unlock(&own->lock);
+    if (job >= 0)
+        return job;
+
+    while (true) {
+        // Rob the worker with the most jobs left
+        int victim = -1, most = 0;
+        for (int i = 0; i < threadCount; i++) {
+            JobQueue* q = &queues[i];
+            pthread_mutex_lock(&q->lock);
+            int left = q->back - q->front;
+            pthread_mutex_unlock(&q->lock);
+            if (i != self && left > most) {
+                victim = i;
+                most = left;
+            }
+        }
+        if (victim < 0)
+            return -1;
+        // Jobs never make new jobs, so the queue may have run dry since
+        JobQueue* q = &queues[victim];
+        pthread_mutex_lock(&q->lock);
+        int left = q->back - q->front;
+        int front = q->front;
+        int taken = (left + 1) / 2;
+        q->front += taken;
+        pthread_mutex_unlock(&q->lock);
+        if (taken == 0)
+            continue;
+        // Run the first one, keep the rest
+        pthread_mutex_lock(&own->lock);
+        own->front = front + 1;
+        own->back = front + taken;
+        pthread_mutex_unlock(&own->lock);
+        return front;
+    }
+}
+
+void* Worker(void* arg) {
+    int self = (int)(intptr_t)arg;
+    int job;
+    while ((job = TakeJob(self)) >= 0)
+        RunJob(&jobs[job]);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0) {
+            printf("pbpu-farm <dir|manifest> [options]\n");
+            printf("Runs every file in dir, or every line \"path [cycles]\" of manifest, headless\n");
+            printf("--help: Print help info\n");
+            printf("--cycles=<num>: Cycle budget for programs without one in the manifest\n");
+            printf("--threads=<num>: Worker threads, one per core by default\n");
+            printf("--skip-loops: Skip whole passes through loops to reach the budget\n");
+            printf("--interpret: Don't use the block translation cache\n");
+            printf("--jit: Compile blocks to x86-64 code\n");
+            return 0;
+        }
+        if (strcmp(argv[i], "--skip-loops") == 0) {
+            skipLoops = true;
+        }
+        if (strcmp(argv[i], "--interpret") == 0) {
+            engine = ENGINE_INTERPRETER;
+        }
+        if (strcmp(argv[i], "--jit") == 0) {
+            engine = ENGINE_JIT;
+        }
+        if (strncmp(argv[i], "--cycles=", 9) == 0) {
+            if (sscanf(argv[i] + 9, "%llu", (unsigned long long*)&maxCycles) != 1) {
+                printf("Invalid cycle count!\n");
+                return 1;
+            }
+        }
+        if (strncmp(argv[i], "--threads=", 10) == 0) {
+            if (sscanf(argv[i] + 10, "%d", &threadCount) != 1 || threadCount <= 0) {
+                printf("Invalid thread count!\n");
+                return 1;
+            }
+        }
+    }
+    if (argc < 2 || argv[1][0] == '-') {
+        printf("No directory or manifest passed in!\n");
+        return 1;
+    }
+    struct stat info;
+    if (stat(argv[1], &info) != 0) {
+        printf("%s not found!\n", argv[1]);
+        return 1;
+    }
+    bool ok = S_ISDIR(info.st_mode) ? AddDirectory(argv[1]) : AddManifest(argv[1]);
+    if (!ok) {
+        printf("Reading %s failed!\n", argv[1]);
+        return 1;
+    }
+    if (jobCount == 0) {
+        printf("No programs to run!\n");
+        return 1;
+    }
+
+    if (threadCount == 0)
+        threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount > jobCount)
+        threadCount = jobCount;
+    if (threadCount < 1)
+        threadCount = 1;
+    // Every worker starts with an even share of the jobs
+    queues = calloc(threadCount, sizeof(JobQueue));
+    pthread_t* threads = calloc(threadCount, sizeof(pthread_t));
+    if (queues == NULL || threads == NULL) {
+        printf("Out of memory!\n");
+        return 1;
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        queues[i].front = (int)((long long)jobCount * i / threadCount);
+        queues[i].back = (int)((long long)jobCount * (i + 1) / threadCount);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threadCount; i++) {
+        if (pthread_create(&threads[i], NULL, Worker, (void*)(intptr_t)i) != 0) {
+            printf("Starting worker threads failed!\n");
+            return 1;
+        }
+    }
+    for (int i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Records in job order, whichever worker ran them
+    for (int i = 0; i < jobCount; i++) {
+        if (jobs[i].record != NULL)
+            fwrite(jobs[i].record, 1, jobs[i].recordSize, stdout);
+        else
+            printf("ROM: %s\nError: out of memory\n", jobs[i].path);
+        printf("\n");
+        free(jobs[i].record);
+        free(jobs[i].path);
+    }
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Ran %d programs on %d threads in %.3f s\n", jobCount, threadCount, secs);
+    free(jobs);
+    free(queues);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,631 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "pbpu_internal.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+
+// Executable buffer per machine, flushed as a whole when full
+#define JIT_BUFFER_SIZE (256 * 1024)
+// Upper bound for the code of one block
+#define JIT_MAX_BLOCK_CODE (320 + BLOCK_MAX_OPS * 160)
+
+// Entered from C, runs blocks until one exits, see JitRun
+typedef uint64_t (*JitEntryFn)(Machine* m, uint64_t budget);
+
+struct JitCache {
+    uint8_t* buffer;
+    size_t used;
+    // Shared entry and exit code at the start of the buffer
+    JitEntryFn enter;
+    uint8_t* exitStub;
+    uint8_t* haltStub;
+    size_t stubsSize;
+    // Native code by entry pc, the exit stub for blocks not compiled yet
+    void* table[256];
+};
+
+// x86-64 register numbers
+enum HostRegs { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13 };
+
+// Where the PBPU registers live while compiled code runs
+#define HOST_MACHINE RDI
+#define HOST_X       R8
+#define HOST_Y       R9
+#define HOST_Z       R10
+#define HOST_LOC     R11
+#define HOST_TMP     RSI
+#define HOST_CARRY   RDX
+// Cycles left in the budget and the address of JitCache.table
+#define HOST_BUDGET  R13
+#define HOST_TABLE   R12
+// rax, rcx and rbx are scratch
+
+// Opcodes for AluRR, op dst, src
+#define ALU_ADD 0x01
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+// /digit of opcode 0x81 for AluRI, op dst, imm32
+#define ALU_I_ADD 0
+#define ALU_I_OR  1
+#define ALU_I_AND 4
+#define ALU_I_SUB 5
+#define ALU_I_CMP 7
+
+// Condition codes for SetCC and Jcc
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+
+typedef struct {
+    uint8_t* p;
+} Emitter;
+
+static void Byte(Emitter* e, uint8_t b) {
+    *e->p++ = b;
+}
+
+static void Imm32(Emitter* e, uint32_t v) {
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+// REX prefix, only emitted when needed. byteReg is set when reg is
+// used as an 8-Bit register, where sil/dil need a REX as well.
+static void Rex(Emitter* e, bool w, int reg, int index, int base, bool byteReg) {
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (rex != 0x40 || (byteReg && reg >= RSP && reg <= RDI))
+        Byte(e, rex);
+}
+
+// ModRM (+ SIB) for [base + index + disp32], index < 0 means none
+static void Mem(Emitter* e, int reg, int base, int index, int32_t disp) {
+    if (index < 0) {
+        Byte(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    } else {
+        Byte(e, 0x80 | ((reg & 7) << 3) | RSP);
+        Byte(e, ((index & 7) << 3) | (base & 7));
+    }
+    Imm32(e, (uint32_t)disp);
+}
+
+// op dst, src
+static void AluRR(Emitter* e, bool w, uint8_t op, int dst, int src) {
+    Rex(e, w, src, 0, dst, false);
+    Byte(e, op);
+    Byte(e, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// op dst, imm32
+static void AluRI(Emitter* e, bool w, int digit, int dst, uint32_t imm) {
+    Rex(e, w, 0, 0, dst, false);
+    Byte(e, 0x81);
+    Byte(e, 0xC0 | (digit << 3) | (dst & 7));
+    Imm32(e, imm);
+}
+
+// 32-Bit shorthands, all PBPU values fit
+#define MOV_RR(e, dst, src) AluRR(e, false, ALU_MOV, dst, src)
+#define AND_RI(e, dst, imm) AluRI(e, false, ALU_I_AND, dst, imm)
+#define OR_RI(e, dst, imm)  AluRI(e, false, ALU_I_OR, dst, imm)
+#define CMP_RI(e, dst, imm) AluRI(e, false, ALU_I_CMP, dst, imm)
+
+static void MovRI(Emitter* e, int dst, uint32_t imm) {
+    Rex(e, false, 0, 0, dst, false);
+    Byte(e, 0xB8 | (dst & 7));
+    Imm32(e, imm);
+}
+
+// mov dst, imm64
+static void MovRI64(Emitter* e, int dst, uint64_t imm) {
+    Rex(e, true, 0, 0, dst, false);
+    Byte(e, 0xB8 | (dst & 7));
+    memcpy(e->p, &imm, 8);
+    e->p += 8;
+}
+
+// shl/shr dst, imm8 (digit 4/5)
+static void ShiftRI(Emitter* e, int digit, int dst, uint8_t imm) {
+    Rex(e, false, 0, 0, dst, false);
+    Byte(e, 0xC1);
+    Byte(e, 0xC0 | (digit << 3) | (dst & 7));
+    Byte(e, imm);
+}
+#define SHL_RI(e, dst, imm) ShiftRI(e, 4, dst, imm)
+#define SHR_RI(e, dst, imm) ShiftRI(e, 5, dst, imm)
+
+// shl/shr dst, cl (digit 4/5)
+static void ShiftRCl(Emitter* e, int digit, int dst) {
+    Rex(e, false, 0, 0, dst, false);
+    Byte(e, 0xD3);
+    Byte(e, 0xC0 | (digit << 3) | (dst & 7));
+}
+
+// setcc dst8
+static void SetCC(Emitter* e, uint8_t cc, int dst) {
+    if (dst >= R8)
+        Byte(e, 0x41);
+    else if (dst >= RSP)
+        Byte(e, 0x40);
+    Byte(e, 0x0F);
+    Byte(e, 0x90 | cc);
+    Byte(e, 0xC0 | (dst & 7));
+}
+
+// movzx dst, byte [base + index + disp]
+static void LoadByte(Emitter* e, int dst, int base, int index, int32_t disp) {
+    Rex(e, false, dst, index < 0 ? 0 : index, base, false);
+    Byte(e, 0x0F);
+    Byte(e, 0xB6);
+    Mem(e, dst, base, index, disp);
+}
+
+// op byte [base + index + disp], src8 with op 0x88 (mov), 0x20 (and) or 0x08 (or)
+static void ByteOpMR(Emitter* e, uint8_t op, int base, int index, int32_t disp, int src) {
+    Rex(e, false, src, index < 0 ? 0 : index, base, true);
+    Byte(e, op);
+    Mem(e, src, base, index, disp);
+}
+
+// op byte [base + disp], imm8 with op 0xC6 /0 (mov) or 0x80 /digit
+static void ByteOpMI(Emitter* e, uint8_t op, int digit, int base, int32_t disp, uint8_t imm) {
+    Rex(e, false, 0, 0, base, false);
+    Byte(e, op);
+    Mem(e, digit, base, -1, disp);
+    Byte(e, imm);
+}
+
+static void Push(Emitter* e, int reg) {
+    Rex(e, false, 0, 0, reg, false);
+    Byte(e, 0x50 | (reg & 7));
+}
+
+static void Pop(Emitter* e, int reg) {
+    Rex(e, false, 0, 0, reg, false);
+    Byte(e, 0x58 | (reg & 7));
+}
+
+// jmp rel32 to target
+static void Jmp(Emitter* e, const uint8_t* target) {
+    Byte(e, 0xE9);
+    Imm32(e, (uint32_t)(target - (e->p + 4)));
+}
+
+// jcc rel32, returns where to patch in the target later
+static uint8_t* JccForward(Emitter* e, uint8_t cc) {
+    Byte(e, 0x0F);
+    Byte(e, 0x80 | cc);
+    Imm32(e, 0);
+    return e->p - 4;
+}
+
+// Point a forward jump at the current position
+static void PatchHere(Emitter* e, uint8_t* rel) {
+    uint32_t disp = (uint32_t)(e->p - (rel + 4));
+    memcpy(rel, &disp, 4);
+}
+
+// jmp [table + rax*8], continues with the block for pc al
+static void DispatchRax(Emitter* e) {
+    Rex(e, false, 0, 0, HOST_TABLE, false);
+    Byte(e, 0xFF);
+    Byte(e, 0x24);
+    Byte(e, 0xC0 | (RAX << 3) | (HOST_TABLE & 7));
+}
+
+#define FIELD(name) ((int32_t)offsetof(Machine, name))
+#define JUMP_FIELD(name) (FIELD(lastJump) + (int32_t)offsetof(JumpState, name))
+
+// locPtr = (locPtr & keep) | set
+static void EmitLoc(Emitter* e, uint8_t keep, uint8_t set) {
+    if (keep == 0) {
+        MovRI(e, HOST_LOC, set);
+        return;
+    }
+    if (keep != 0xFF)
+        AND_RI(e, HOST_LOC, keep);
+    if (set != 0)
+        OR_RI(e, HOST_LOC, set);
+}
+
+// eax = locPtr / 2, ecx = 4-Bit shift of the nibble in that byte
+static void EmitNibbleAddr(Emitter* e) {
+    MOV_RR(e, RAX, HOST_LOC);
+    SHR_RI(e, RAX, 1);
+    MOV_RR(e, RCX, HOST_LOC);
+    AND_RI(e, RCX, 1);
+    SHL_RI(e, RCX, 2);
+}
+
+// rol/ror bl, cl (digit 0/1), swaps the nibbles of bl when cl is 4
+static void RotateBlCl(Emitter* e, int digit) {
+    Byte(e, 0xD2);
+    Byte(e, 0xC0 | (digit << 3) | RBX);
+}
+
+// ram[locPtr] = Z, or the constant z if it is >= 0. The nibble is
+// merged in a register so every store is one load and one store,
+// read-modify-write on memory would chain on store forwarding.
+static void EmitStore(Emitter* e, uint8_t keep, uint8_t set, int z) {
+    EmitLoc(e, keep, set);
+    ByteOpMI(e, 0xC6, 0, HOST_MACHINE, FIELD(ramDirty), 1);
+    ByteOpMI(e, 0xC6, 0, HOST_MACHINE, FIELD(storedSinceJump), 1);
+    if (keep == 0) {
+        // Address known while compiling
+        int32_t disp = FIELD(ram) + set / 2;
+        int shift = (set & 1) * 4;
+        LoadByte(e, RBX, HOST_MACHINE, -1, disp);
+        AND_RI(e, RBX, ~(0xF << shift) & 0xFF);
+        if (z >= 0) {
+            if (z != 0)
+                OR_RI(e, RBX, z << shift);
+        } else {
+            MOV_RR(e, RAX, HOST_Z);
+            if (shift)
+                SHL_RI(e, RAX, shift);
+            AluRR(e, false, 0x09, RBX, RAX); // or
+        }
+        ByteOpMR(e, 0x88, HOST_MACHINE, -1, disp, RBX);
+        if (set < 4)
+            ByteOpMI(e, 0xC6, 0, HOST_MACHINE, FIELD(screenDirty), 1);
+        return;
+    }
+    EmitNibbleAddr(e);
+    // Rotate the nibble to the bottom, replace it, rotate back
+    LoadByte(e, RBX, HOST_MACHINE, RAX, FIELD(ram));
+    RotateBlCl(e, 1);
+    AND_RI(e, RBX, 0xF0);
+    if (z >= 0) {
+        if (z != 0)
+            OR_RI(e, RBX, z);
+    } else {
+        AluRR(e, false, 0x09, RBX, HOST_Z); // or
+    }
+    RotateBlCl(e, 0);
+    ByteOpMR(e, 0x88, HOST_MACHINE, RAX, FIELD(ram), RBX);
+    // screenDirty |= locPtr < 4
+    CMP_RI(e, HOST_LOC, 4);
+    uint8_t* offScreen = JccForward(e, CC_AE);
+    ByteOpMI(e, 0xC6, 0, HOST_MACHINE, FIELD(screenDirty), 1);
+    PatchHere(e, offScreen);
+}
+
+// dst = ram[locPtr]
+static void EmitLoad(Emitter* e, uint8_t keep, uint8_t set, int dst) {
+    EmitLoc(e, keep, set);
+    if (keep == 0) {
+        int shift = (set & 1) * 4;
+        LoadByte(e, dst, HOST_MACHINE, -1, FIELD(ram) + set / 2);
+        if (shift)
+            SHR_RI(e, dst, shift);
+    } else {
+        EmitNibbleAddr(e);
+        LoadByte(e, dst, HOST_MACHINE, RAX, FIELD(ram));
+        ShiftRCl(e, 5, dst);
+    }
+    AND_RI(e, dst, 0xF);
+}
+
+// Z = X + Y + carry, carry = bit 4
+static void EmitAdd(Emitter* e) {
+    LoadByte(e, RAX, HOST_MACHINE, -1, FIELD(useCarry));
+    AluRR(e, false, ALU_AND, RAX, HOST_CARRY);
+    AluRR(e, false, ALU_ADD, RAX, HOST_X);
+    AluRR(e, false, ALU_ADD, RAX, HOST_Y);
+    AluRR(e, false, ALU_MOV, HOST_CARRY, RAX);
+    SHR_RI(e, HOST_CARRY, 4);
+    AND_RI(e, HOST_CARRY, 1);
+    AND_RI(e, RAX, 0xF);
+    AluRR(e, false, ALU_MOV, HOST_Z, RAX);
+}
+
+// Z = X - (Y + carry), carry = X >= Y + carry
+static void EmitSub(Emitter* e) {
+    LoadByte(e, RCX, HOST_MACHINE, -1, FIELD(useCarry));
+    AluRR(e, false, ALU_AND, RCX, HOST_CARRY);
+    AluRR(e, false, ALU_ADD, RCX, HOST_Y);
+    AluRR(e, false, ALU_MOV, RAX, HOST_X);
+    AluRR(e, false, ALU_SUB, RAX, RCX);
+    AND_RI(e, RAX, 0xF);
+    AluRR(e, false, ALU_XOR, HOST_CARRY, HOST_CARRY);
+    AluRR(e, false, ALU_CMP, HOST_X, RCX);
+    SetCC(e, CC_AE, HOST_CARRY);
+    AluRR(e, false, ALU_MOV, HOST_Z, RAX);
+}
+
+// Registers that get loaded on entry and written back on exit
+static const struct {
+    int reg;
+    int32_t offset;
+} hostRegs[] = {
+    { HOST_X, FIELD(regX) },
+    { HOST_Y, FIELD(regY) },
+    { HOST_Z, FIELD(regZ) },
+    { HOST_LOC, FIELD(locPtr) },
+    { HOST_TMP, FIELD(tmpPcPtr) },
+    { HOST_CARRY, FIELD(carry) }
+};
+
+// Load the PBPU registers into host registers
+static void EmitLoadRegs(Emitter* e) {
+    for (size_t i = 0; i < sizeof(hostRegs)/sizeof(hostRegs[0]); i++)
+        LoadByte(e, hostRegs[i].reg, HOST_MACHINE, -1, hostRegs[i].offset);
+}
+
+// Write the host registers back to the machine
+static void EmitStoreRegs(Emitter* e) {
+    for (size_t i = 0; i < sizeof(hostRegs)/sizeof(hostRegs[0]); i++)
+        ByteOpMR(e, 0x88, HOST_MACHINE, -1, hostRegs[i].offset, hostRegs[i].reg);
+}
+
+// Compare the registers after a taken JMP with Machine.lastJump and
+// halt if they match without a ZTR in between, like JumpHalts in
+// libpbpu.c. Otherwise they become the new lastJump.
+static void EmitJumpState(struct JitCache* jit, Emitter* e, uint8_t jmpPc) {
+    static const struct {
+        int reg;
+        int32_t offset;
+    } fields[] = {
+        { HOST_TMP, JUMP_FIELD(tmpPcPtr) },
+        { HOST_X, JUMP_FIELD(regX) },
+        { HOST_Y, JUMP_FIELD(regY) },
+        { HOST_Z, JUMP_FIELD(regZ) },
+        { HOST_LOC, JUMP_FIELD(locPtr) },
+        { HOST_CARRY, JUMP_FIELD(carry) },
+        { RCX, JUMP_FIELD(useCarry) }
+    };
+    const int count = sizeof(fields)/sizeof(fields[0]);
+    uint8_t* differs[2 + sizeof(fields)/sizeof(fields[0])];
+
+    LoadByte(e, RCX, HOST_MACHINE, -1, FIELD(useCarry));
+    ByteOpMI(e, 0x80, ALU_I_CMP, HOST_MACHINE, FIELD(storedSinceJump), 0);
+    differs[0] = JccForward(e, CC_NE);
+    ByteOpMI(e, 0x80, ALU_I_CMP, HOST_MACHINE, JUMP_FIELD(jmpPc), jmpPc);
+    differs[1] = JccForward(e, CC_NE);
+    for (int i = 0; i < count; i++) {
+        ByteOpMR(e, 0x38, HOST_MACHINE, -1, fields[i].offset, fields[i].reg); // cmp
+        differs[i+2] = JccForward(e, CC_NE);
+    }
+    Jmp(e, jit->haltStub);
+
+    for (int i = 0; i < count + 2; i++)
+        PatchHere(e, differs[i]);
+    ByteOpMI(e, 0xC6, 0, HOST_MACHINE, FIELD(storedSinceJump), 0);
+    ByteOpMI(e, 0xC6, 0, HOST_MACHINE, JUMP_FIELD(jmpPc), jmpPc);
+    for (int i = 0; i < count; i++)
+        ByteOpMR(e, 0x88, HOST_MACHINE, -1, fields[i].offset, fields[i].reg);
+}
+
+// Entry trampoline and the shared exits, rax holds the pc to stop at
+static void EmitStubs(struct JitCache* jit, Emitter* e) {
+    // uint64_t enter(Machine* m, uint64_t budget)
+    jit->enter = (JitEntryFn)(void*)e->p;
+    Push(e, RBX);
+    Push(e, HOST_TABLE);
+    Push(e, HOST_BUDGET);
+    AluRR(e, true, ALU_MOV, HOST_BUDGET, RSI);
+    MovRI64(e, HOST_TABLE, (uint64_t)(uintptr_t)jit->table);
+    EmitLoadRegs(e);
+    LoadByte(e, RAX, HOST_MACHINE, -1, FIELD(pcPtr));
+    DispatchRax(e);
+
+    // Halted, tell JitRun through the top bit of the budget
+    jit->haltStub = e->p;
+    Rex(e, true, 0, 0, HOST_BUDGET, false);
+    Byte(e, 0x0F);
+    Byte(e, 0xBA);
+    Byte(e, 0xE8 | (HOST_BUDGET & 7));
+    Byte(e, 63);
+
+    // Falls through from haltStub
+    jit->exitStub = e->p;
+    EmitStoreRegs(e);
+    ByteOpMR(e, 0x88, HOST_MACHINE, -1, FIELD(pcPtr), RAX);
+    AluRR(e, true, ALU_MOV, RAX, HOST_BUDGET);
+    Pop(e, HOST_BUDGET);
+    Pop(e, HOST_TABLE);
+    Pop(e, RBX);
+    Byte(e, 0xC3); // ret
+}
+
+// Emit a whole block. It charges its cycles up front, leaves through
+// exitStub with its own pc when the budget can't cover it, and jumps
+// straight into the next block through the table otherwise.
+static void EmitBlock(struct JitCache* jit, Emitter* e, const Block* b, uint8_t entry) {
+    AluRI(e, true, ALU_I_CMP, HOST_BUDGET, b->length);
+    uint8_t* overBudget = JccForward(e, CC_B);
+    AluRI(e, true, ALU_I_SUB, HOST_BUDGET, b->length);
+
+    for (int i = 0; i < b->count; i++) {
+        const BlockOp* op = &b->ops[i];
+        switch(op->kind) {
+            case BOP_SETX:
+                MovRI(e, HOST_X, op->a);
+                break;
+            case BOP_SETY:
+                MovRI(e, HOST_Y, op->a);
+                break;
+            case BOP_SETXY:
+                MovRI(e, HOST_X, op->a);
+                MovRI(e, HOST_Y, op->b);
+                break;
+            case BOP_SETZ:
+                MovRI(e, HOST_Z, op->a);
+                break;
+            case BOP_ADD:
+                EmitAdd(e);
+                break;
+            case BOP_SUB:
+                EmitSub(e);
+                break;
+            case BOP_ADDST:
+                EmitAdd(e);
+                EmitStore(e, op->a, op->b, -1);
+                break;
+            case BOP_SUBST:
+                EmitSub(e);
+                EmitStore(e, op->a, op->b, -1);
+                break;
+            case BOP_STI:
+                MovRI(e, HOST_Z, op->c);
+                EmitStore(e, op->a, op->b, op->c);
+                break;
+            case BOP_ST:
+                EmitStore(e, op->a, op->b, -1);
+                break;
+            case BOP_LDZ:
+                EmitLoad(e, op->a, op->b, HOST_Z);
+                break;
+            case BOP_LDX:
+                EmitLoad(e, op->a, op->b, HOST_X);
+                break;
+            case BOP_LDY:
+                EmitLoad(e, op->a, op->b, HOST_Y);
+                break;
+            case BOP_USC:
+                ByteOpMI(e, 0x80, 6, HOST_MACHINE, FIELD(useCarry), 1);
+                break;
+        }
+    }
+
+    // Pending WT1/WT2 and PC1/PC2 writes
+    EmitLoc(e, b->locKeep, b->locSet);
+    if (b->tmpKeep != 0xFF)
+        AND_RI(e, HOST_TMP, b->tmpKeep);
+    if (b->tmpSet != 0)
+        OR_RI(e, HOST_TMP, b->tmpSet);
+
+    uint8_t* noJump = NULL;
+    if (b->endsInJmp) {
+        // Only perform JMP if Z is 0
+        AluRR(e, false, 0x85, HOST_Z, HOST_Z); // test
+        noJump = JccForward(e, CC_NE);
+        uint8_t jmpPc = entry + b->length - 1;
+        MOV_RR(e, RAX, HOST_TMP);
+        // A JMP onto itself can never change state again
+        CMP_RI(e, HOST_TMP, jmpPc);
+        uint8_t* notHalted = JccForward(e, CC_NE);
+        Jmp(e, jit->haltStub);
+        PatchHere(e, notHalted);
+        EmitJumpState(jit, e, jmpPc);
+        DispatchRax(e);
+        PatchHere(e, noJump);
+    }
+    MovRI(e, RAX, (uint8_t)(entry + b->length));
+    DispatchRax(e);
+
+    PatchHere(e, overBudget);
+    MovRI(e, RAX, entry);
+    Jmp(e, jit->exitStub);
+}
+
+// Drop all compiled blocks, the stubs stay
+static void Flush(struct JitCache* jit) {
+    for (int i = 0; i < 256; i++)
+        jit->table[i] = jit->exitStub;
+    jit->used = jit->stubsSize;
+}
+
+// Map the code buffer and emit the stubs, false if that isn't possible
+static bool Init(Machine* m) {
+    struct JitCache* jit = calloc(1, sizeof(struct JitCache));
+    if (jit == NULL)
+        return false;
+    void* buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        free(jit);
+        return false;
+    }
+    jit->buffer = buffer;
+    Emitter e = { jit->buffer };
+    EmitStubs(jit, &e);
+    jit->stubsSize = (e.p - jit->buffer + 15) & ~(size_t)15;
+    // Never writable and executable at the same time
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        munmap(jit->buffer, JIT_BUFFER_SIZE);
+        free(jit);
+        return false;
+    }
+    Flush(jit);
+    m->jit = jit;
+    return true;
+}
+
+bool JitCompile(Machine* m, uint8_t entry) {
+    if (m->jit == NULL && !Init(m))
+        return false;
+    struct JitCache* jit = m->jit;
+    if (jit->table[entry] != jit->exitStub)
+        return true;
+
+    if (jit->used + JIT_MAX_BLOCK_CODE > JIT_BUFFER_SIZE)
+        Flush(jit);
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0)
+        return false;
+    Emitter e = { jit->buffer + jit->used };
+    EmitBlock(jit, &e, &m->blocks[entry], entry);
+    void* code = jit->buffer + jit->used;
+    jit->used = (e.p - jit->buffer + 15) & ~(size_t)15;
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0)
+        return false;
+    jit->table[entry] = code;
+    return true;
+}
+
+uint64_t JitRun(Machine* m, uint64_t maxCycles, bool* halted) {
+    // The top bit is the halt flag
+    if (maxCycles >> 63)
+        maxCycles = ~0ULL >> 1;
+    uint64_t left = m->jit->enter(m, maxCycles);
+    *halted = left >> 63;
+    return maxCycles - (left & (~0ULL >> 1));
+}
+
+void JitInvalidate(Machine* m) {
+    if (m->jit != NULL)
+        Flush(m->jit);
+}
+
+void JitFree(Machine* m) {
+    if (m->jit == NULL)
+        return;
+    munmap(m->jit->buffer, JIT_BUFFER_SIZE);
+    free(m->jit);
+    m->jit = NULL;
+}
+
+#else
+
+// No JIT for this host, everything stays on the block interpreter
+bool JitCompile(Machine* m, uint8_t entry) {
+    (void)m;
+    (void)entry;
+    return false;
+}
+
+uint64_t JitRun(Machine* m, uint64_t maxCycles, bool* halted) {
+    (void)m;
+    (void)maxCycles;
+    *halted = false;
+    return 0;
+}
+
+void JitInvalidate(Machine* m) {
+    (void)m;
+}
+
+void JitFree(Machine* m) {
+    (void)m;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef PBPU_JIT_H
+#define PBPU_JIT_H
+
+#include "libpbpu.h"
+
+// Compile the translated block at entry to native code. False if the
+// JIT isn't available here, the caller has to run the block some
+// other way then.
+bool JitCompile(Machine* m, uint8_t entry);
+// Run compiled blocks from pcPtr, chaining from block to block without
+// leaving native code. Stops at the first block that isn't compiled or
+// doesn't fit into maxCycles. Returns the cycles executed, halted is
+// set when a loop reached a fixed point.
+uint64_t JitRun(Machine* m, uint64_t maxCycles, bool* halted);
+// Forget all compiled code, needed whenever rom changes
+void JitInvalidate(Machine* m);
+// Release the code buffer of a machine
+void JitFree(Machine* m);
+
+#endif
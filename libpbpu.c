@@ -0,0 +1,944 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pbpu_internal.h"
+#include "jit.h"
+#include "profile.h"
+
+// Use the threaded interpreter where labels-as-values are available,
+// build with -DPBPU_SWITCH_DISPATCH to force the plain switch loop
+#if defined(__GNUC__) && !defined(PBPU_SWITCH_DISPATCH)
+#define PBPU_THREADED
+#endif
+
+// Clang has no per-function optimize attribute and doesn't need it
+#if defined(__clang__)
+#define NO_CROSSJUMPING
+#else
+#define NO_CROSSJUMPING __attribute__((optimize("no-crossjumping")))
+#endif
+
+// Mnemonic of an opcode
+const char* OpCodeName(uint8_t op) {
+    switch(op) {
+        case OP_NOP: return "NOP";
+        case OP_ADD: return "ADD";
+        case OP_SUB: return "SUB";
+        case OP_WT1: return "WT1";
+        case OP_WT2: return "WT2";
+        case OP_WTX: return "WTX";
+        case OP_WTY: return "WTY";
+        case OP_WTZ: return "WTZ";
+        case OP_ZTR: return "ZTR";
+        case OP_RTZ: return "RTZ";
+        case OP_PC1: return "PC1";
+        case OP_PC2: return "PC2";
+        case OP_JMP: return "JMP";
+        case OP_RTX: return "RTX";
+        case OP_RTY: return "RTY";
+        case OP_USC: return "USC";
+    }
+    return "ERR";
+}
+
+// Mnemonic of the instruction at addr
+const char* DecodeOpCode(const uint8_t* buff, int addr) {
+    return OpCodeName((buff[addr] & 0xF0) >> 4);
+}
+
+// Registers only ever hold 4-Bit values, ADD and SUB are the only
+// instructions that can produce more and mask their result right away
+#define DO_ADD() \
+    do { \
+        uint8_t aluOut = regX + regY + (useCarry & carry); \
+        regZ = aluOut & 0xF; \
+        carry = aluOut >> 4; \
+    } while (0)
+#define DO_SUB() \
+    do { \
+        uint8_t subTmp = regY + (useCarry & carry); \
+        regZ = (regX - subTmp) & 0xF; \
+        carry = regX >= subTmp; \
+    } while (0)
+
+// Split one rom byte into its predecoded slot
+static void DecodeSlot(Machine* m, uint8_t addr) {
+    m->code[addr].op = m->rom[addr] >> 4;
+    m->code[addr].imm = m->rom[addr] & 0xF;
+}
+
+// Drop everything derived from rom
+static void InvalidateCode(Machine* m) {
+    // Handlers are filled in lazily by the threaded interpreter
+    m->handlersValid = false;
+    // Any block may run across the changed byte
+    for (int addr = 0; addr < (int)sizeof(m->rom); addr++)
+        m->blocks[addr].valid = false;
+    JitInvalidate(m);
+}
+
+// Decode the whole rom, needed whenever rom is replaced
+static void Predecode(Machine* m) {
+    for (int addr = 0; addr < (int)sizeof(m->rom); addr++)
+        DecodeSlot(m, addr);
+    InvalidateCode(m);
+}
+
+// Change one rom byte, e.g. from a debugger
+void PatchRom(Machine* m, uint8_t addr, uint8_t val) {
+    m->rom[addr] = val;
+    DecodeSlot(m, addr);
+    InvalidateCode(m);
+}
+
+// Write a 4-Bit value to the buffer
+static inline void RamWrite(uint8_t* buff, uint8_t addr, uint8_t val) {
+    if (addr % 2 == 0)
+        buff[addr/2] = (buff[addr/2] & 0xF0) | (val & 0x0F);
+    else
+        buff[addr/2] = (buff[addr/2] & 0x0F) | ((val & 0x0F) << 4);
+}
+
+// Read a 4-Bit value from the buffer
+static inline uint8_t RamRead(const uint8_t* buff, uint8_t addr) {
+    if (addr % 2 == 0)
+        return buff[addr/2] & 0x0F;
+    else
+        return (buff[addr/2] >> 4) & 0x0F;
+}
+
+// Write a 4-Bit value to ram. Counts as a store like ZTR, so a loop
+// waiting for the value doesn't halt before it reads it.
+void WriteNibble(Machine* m, uint8_t addr, uint8_t val) {
+    RamWrite(m->ram, addr, val);
+    m->ramDirty = true;
+    m->storedSinceJump = true;
+    if (addr < 4)
+        m->screenDirty = true;
+}
+
+// Read a 4-Bit value from ram
+uint8_t ReadNibble(const Machine* m, uint8_t addr) {
+    return RamRead(m->ram, addr);
+}
+
+// Limit registers to 4-Bit range
+static void LimitRegs(Machine* m) {
+    m->regX &= 0xF;
+    m->regY &= 0xF;
+    m->regZ &= 0xF;
+}
+
+// Allocate a machine in its power-on state
+Machine* CreateMachine(void) {
+    Machine* m = calloc(1, sizeof(Machine));
+    if (m == NULL) return NULL;
+    ResetMachine(m);
+    return m;
+}
+
+void DestroyMachine(Machine* m) {
+    JitFree(m);
+    free(m);
+}
+
+// Reset registers and ram, rom is left untouched
+void ResetMachine(Machine* m) {
+    memset(m->ram, 0, sizeof(m->ram));
+    m->pcPtr = 0;
+    m->tmpPcPtr = 0;
+    m->locPtr = 0;
+    m->regX = m->regY = m->regZ = 0;
+    m->useCarry = false;
+    m->carry = false;
+    m->cycles = 0;
+    m->ramDirty = true;
+    m->screenDirty = true;
+    // All zero only matches a JMP at 0 onto itself, which halts anyway
+    memset(&m->lastJump, 0, sizeof(m->lastJump));
+    m->storedSinceJump = false;
+}
+
+// Copy a program into rom, the rest of rom is cleared
+size_t LoadRom(Machine* m, const uint8_t* data, size_t size) {
+    if (size > sizeof(m->rom))
+        size = sizeof(m->rom);
+    memset(m->rom, 0, sizeof(m->rom));
+    memcpy(m->rom, data, size);
+    Predecode(m);
+    return size;
+}
+
+// Load a program file into rom
+long LoadRomFile(Machine* m, const char* path) {
+    FILE* prgFile = fopen(path, "rb");
+    if (prgFile == NULL)
+        return -1;
+    uint8_t buff[sizeof(m->rom)];
+    size_t readBytes = fread(buff, sizeof(uint8_t), sizeof(m->rom) - 1, prgFile);
+    fclose(prgFile);
+    return (long)LoadRom(m, buff, readBytes);
+}
+
+void GetState(const Machine* m, MachineState* state) {
+    memcpy(state->rom, m->rom, sizeof(state->rom));
+    memcpy(state->ram, m->ram, sizeof(state->ram));
+    state->pcPtr = m->pcPtr;
+    state->tmpPcPtr = m->tmpPcPtr;
+    state->locPtr = m->locPtr;
+    state->regX = m->regX;
+    state->regY = m->regY;
+    state->regZ = m->regZ;
+    state->useCarry = m->useCarry;
+    state->carry = m->carry;
+    state->cycles = m->cycles;
+}
+
+// Registers are masked so a bad state can't break the 4-Bit invariant
+void SetState(Machine* m, const MachineState* state) {
+    memcpy(m->rom, state->rom, sizeof(m->rom));
+    memcpy(m->ram, state->ram, sizeof(m->ram));
+    Predecode(m);
+    m->pcPtr = state->pcPtr;
+    m->tmpPcPtr = state->tmpPcPtr;
+    m->locPtr = state->locPtr;
+    m->regX = state->regX;
+    m->regY = state->regY;
+    m->regZ = state->regZ;
+    m->useCarry = state->useCarry;
+    m->carry = state->carry;
+    m->cycles = state->cycles;
+    LimitRegs(m);
+    m->ramDirty = true;
+    m->screenDirty = true;
+    memset(&m->lastJump, 0, sizeof(m->lastJump));
+    m->storedSinceJump = false;
+}
+
+// Out of line so the engines don't keep registers free for it
+static __attribute__((noinline)) void CountJump(Profile* profile, uint8_t jmpPc, uint8_t target) {
+    profile->jumps[jmpPc]++;
+    profile->jumpTarget[jmpPc] = target;
+    profile->entries[target]++;
+}
+
+// Called by every engine on a taken JMP, true once the machine reached
+// a fixed point. That is a JMP onto itself, or a loop pass without ZTR
+// that ended with the same registers as the pass before.
+static inline bool JumpHalts(Machine* m, JumpState now, bool* stored) {
+    if (__builtin_expect(m->profile != NULL, 0))
+        CountJump(m->profile, now.jmpPc, now.tmpPcPtr);
+    if (now.tmpPcPtr == now.jmpPc)
+        return true;
+    JumpState* last = &m->lastJump;
+    bool again = !*stored && last->jmpPc == now.jmpPc && last->tmpPcPtr == now.tmpPcPtr
+        && last->locPtr == now.locPtr && last->regX == now.regX
+        && last->regY == now.regY && last->regZ == now.regZ
+        && last->useCarry == now.useCarry && last->carry == now.carry;
+    // Field by field, GCC builds a copy of the whole struct in a register first
+    last->jmpPc = now.jmpPc;
+    last->tmpPcPtr = now.tmpPcPtr;
+    last->locPtr = now.locPtr;
+    last->regX = now.regX;
+    last->regY = now.regY;
+    last->regZ = now.regZ;
+    last->useCarry = now.useCarry;
+    last->carry = now.carry;
+    *stored = false;
+    return again;
+}
+
+// State after the JMP at jmpPc, in terms of the engine's locals
+#define JUMP_STATE(jmpPc) \
+    ((JumpState){ (jmpPc), tmpPcPtr, locPtr, regX, regY, regZ, useCarry, carry })
+
+static StopReason Interpret(Machine* m, uint64_t maxCycles);
+
+// Run with an engine and count where the run started and stopped,
+// the taken JMPs in between count themselves in JumpHalts
+static StopReason RunProfiled(Machine* m, uint64_t maxCycles,
+        StopReason (*run)(Machine*, uint64_t)) {
+    Profile* profile = m->profile;
+    uint64_t before = m->cycles;
+    profile->entries[m->pcPtr]++;
+    StopReason reason = run(m, maxCycles);
+    profile->exits[m->pcPtr]++;
+    profile->cycles += m->cycles - before;
+    return reason;
+}
+
+// Perform a single simulation step
+void SimStep(Machine* m) {
+    if (m->profile != NULL)
+        RunProfiled(m, 1, Interpret);
+    else
+        Interpret(m, 1);
+}
+
+#ifndef PBPU_THREADED
+// Switch based interpreter loop. Registers are kept in locals for the whole
+// run and only written back when stopping. Always inlined so each
+// caller gets a copy specialised on checkBreak.
+static inline __attribute__((always_inline))
+StopReason RunLoop(Machine* m, uint64_t maxCycles, const bool checkBreak) {
+    const DecodedOp* code = m->code;
+    uint8_t* ram = m->ram;
+    uint8_t pcPtr = m->pcPtr;
+    uint8_t tmpPcPtr = m->tmpPcPtr;
+    uint8_t locPtr = m->locPtr;
+    uint8_t regX = m->regX, regY = m->regY, regZ = m->regZ;
+    bool useCarry = m->useCarry;
+    bool carry = m->carry;
+    bool ramDirty = false, screenDirty = false;
+    bool stored = m->storedSinceJump;
+    bool breakOnScreen = m->breakOnScreen;
+    StopReason reason = STOP_BUDGET;
+    bool stop = false;
+    uint64_t executed = 0;
+
+    while (executed < maxCycles) {
+        uint8_t op = code[pcPtr].op;
+        uint8_t imm = code[pcPtr].imm;
+        executed++;
+        switch(op) {
+            case OP_NOP:
+                break;
+            case OP_ADD:
+                DO_ADD();
+                break;
+            // This may not be 100% accurate, due to me
+            // being unsure how logisim implements these
+            case OP_SUB:
+                DO_SUB();
+                break;
+            case OP_WT1:
+                locPtr = (locPtr & 0x0F) | (imm << 4);
+                break;
+            case OP_WT2:
+                locPtr = (locPtr & 0xF0) | (imm);
+                break;
+            case OP_WTX:
+                regX = imm;
+                break;
+            case OP_WTY:
+                regY = imm;
+                break;
+            case OP_WTZ:
+                regZ = imm;
+                break;
+            case OP_ZTR:
+                RamWrite(ram, locPtr, regZ);
+                ramDirty = stored = true;
+                if (locPtr < 4) {
+                    screenDirty = true;
+                    if (breakOnScreen) {
+                        reason = STOP_SCREEN;
+                        stop = true;
+                    }
+                }
+                break;
+            case OP_RTZ:
+                regZ = RamRead(ram, locPtr);
+                break;
+            case OP_PC1:
+                tmpPcPtr = (tmpPcPtr & 0xF0) | (imm);
+                break;
+            case OP_PC2:
+                tmpPcPtr = (tmpPcPtr & 0x0F) | (imm << 4);
+                break;
+            case OP_JMP:
+                // Only perform JMP if Z is 0
+                if (regZ == 0x0) {
+                    if (JumpHalts(m, JUMP_STATE(pcPtr), &stored)) {
+                        reason = STOP_HALT;
+                        stop = true;
+                    }
+                    // Needs to be here due to a hardware quirk
+                    pcPtr = tmpPcPtr-1;
+                }
+                break;
+            case OP_RTX:
+                regX = RamRead(ram, locPtr);
+                break;
+            case OP_RTY:
+                regY = RamRead(ram, locPtr);
+                break;
+            case OP_USC:
+                useCarry = !useCarry;
+                break;
+        }
+        pcPtr++;
+
+        if (stop)
+            break;
+        if (checkBreak && m->breakpoints[pcPtr]) {
+            reason = STOP_BREAKPOINT;
+            break;
+        }
+    }
+
+    m->pcPtr = pcPtr;
+    m->tmpPcPtr = tmpPcPtr;
+    m->locPtr = locPtr;
+    m->regX = regX;
+    m->regY = regY;
+    m->regZ = regZ;
+    m->useCarry = useCarry;
+    m->carry = carry;
+    m->cycles += executed;
+    m->ramDirty |= ramDirty;
+    m->storedSinceJump = stored;
+    m->screenDirty |= screenDirty;
+    return reason;
+}
+#endif
+
+#ifdef PBPU_THREADED
+// Threaded interpreter using GCC labels-as-values. Every handler
+// ends in its own copy of the dispatch jump, so the branch predictor
+// sees one indirect branch per opcode instead of one shared one.
+// Cross-jumping is off, otherwise GCC merges those copies again.
+NO_CROSSJUMPING
+static StopReason RunThreaded(Machine* m, uint64_t maxCycles) {
+    static const void* const handlers[16] = {
+        &&op_nop, &&op_add, &&op_sub, &&op_wt1,
+        &&op_wt2, &&op_wtx, &&op_wty, &&op_wtz,
+        &&op_ztr, &&op_rtz, &&op_pc1, &&op_pc2,
+        &&op_jmp, &&op_rtx, &&op_rty, &&op_usc
+    };
+    const DecodedOp* code = m->code;
+    uint8_t* ram = m->ram;
+    uint8_t pcPtr = m->pcPtr;
+    uint8_t tmpPcPtr = m->tmpPcPtr;
+    uint8_t locPtr = m->locPtr;
+    uint8_t regX = m->regX, regY = m->regY, regZ = m->regZ;
+    bool useCarry = m->useCarry;
+    bool carry = m->carry;
+    bool ramDirty = false, screenDirty = false;
+    bool stored = m->storedSinceJump;
+    bool breakOnScreen = m->breakOnScreen;
+    StopReason reason = STOP_BUDGET;
+    uint64_t executed = 0;
+    uint8_t imm;
+
+// Finish the current instruction, then jump to the next handler
+#define NEXT() \
+    do { \
+        pcPtr++; \
+        if (++executed == maxCycles) goto done; \
+        imm = code[pcPtr].imm; \
+        goto *code[pcPtr].handler; \
+    } while (0)
+// Finish the current instruction, then leave the loop
+#define STOP(why) \
+    do { \
+        pcPtr++; \
+        executed++; \
+        reason = why; \
+        goto done; \
+    } while (0)
+
+    // Slots with a breakpoint get the trap instead of their handler
+    if (!m->handlersValid) {
+        for (int addr = 0; addr < (int)sizeof(m->rom); addr++) {
+            m->code[addr].handler = m->breakpoints[addr] ? &&check_break : handlers[m->code[addr].op];
+        }
+        m->handlersValid = true;
+    }
+
+    if (maxCycles == 0) goto done;
+    // The instruction we start on never triggers its breakpoint
+    imm = code[pcPtr].imm;
+    goto *handlers[code[pcPtr].op];
+
+check_break:
+    reason = STOP_BREAKPOINT;
+    goto done;
+
+op_nop:
+    NEXT();
+op_add:
+    DO_ADD();
+    NEXT();
+// This may not be 100% accurate, due to me
+// being unsure how logisim implements these
+op_sub:
+    DO_SUB();
+    NEXT();
+op_wt1:
+    locPtr = (locPtr & 0x0F) | (imm << 4);
+    NEXT();
+op_wt2:
+    locPtr = (locPtr & 0xF0) | (imm);
+    NEXT();
+op_wtx:
+    regX = imm;
+    NEXT();
+op_wty:
+    regY = imm;
+    NEXT();
+op_wtz:
+    regZ = imm;
+    NEXT();
+op_ztr:
+    RamWrite(ram, locPtr, regZ);
+    ramDirty = stored = true;
+    if (locPtr < 4) {
+        screenDirty = true;
+        if (breakOnScreen)
+            STOP(STOP_SCREEN);
+    }
+    NEXT();
+op_rtz:
+    regZ = RamRead(ram, locPtr);
+    NEXT();
+op_pc1:
+    tmpPcPtr = (tmpPcPtr & 0xF0) | (imm);
+    NEXT();
+op_pc2:
+    tmpPcPtr = (tmpPcPtr & 0x0F) | (imm << 4);
+    NEXT();
+op_jmp:
+    // Only perform JMP if Z is 0
+    if (regZ == 0x0) {
+        bool halt = JumpHalts(m, JUMP_STATE(pcPtr), &stored);
+        // Needs to be here due to a hardware quirk
+        pcPtr = tmpPcPtr-1;
+        if (halt)
+            STOP(STOP_HALT);
+    }
+    NEXT();
+op_rtx:
+    regX = RamRead(ram, locPtr);
+    NEXT();
+op_rty:
+    regY = RamRead(ram, locPtr);
+    NEXT();
+op_usc:
+    useCarry = !useCarry;
+    NEXT();
+
+#undef NEXT
+#undef STOP
+
+done:
+    // Same precedence as RunLoop when the budget ends on a breakpoint
+    if (reason == STOP_BUDGET && executed > 0 && m->breakpoints[pcPtr])
+        reason = STOP_BREAKPOINT;
+    m->pcPtr = pcPtr;
+    m->tmpPcPtr = tmpPcPtr;
+    m->locPtr = locPtr;
+    m->regX = regX;
+    m->regY = regY;
+    m->regZ = regZ;
+    m->useCarry = useCarry;
+    m->carry = carry;
+    m->cycles += executed;
+    m->ramDirty |= ramDirty;
+    m->storedSinceJump = stored;
+    m->screenDirty |= screenDirty;
+    return reason;
+}
+#endif
+
+// Run up to maxCycles steps one instruction at a time
+static StopReason Interpret(Machine* m, uint64_t maxCycles) {
+#ifdef PBPU_THREADED
+    return RunThreaded(m, maxCycles);
+#else
+    if (m->breakpointCount > 0)
+        return RunLoop(m, maxCycles, true);
+    return RunLoop(m, maxCycles, false);
+#endif
+}
+
+// Append an op to the block being translated
+static void EmitOp(Block* b, uint8_t kind, uint8_t a, uint8_t b2) {
+    b->ops[b->count].kind = kind;
+    b->ops[b->count].a = a;
+    b->ops[b->count].b = b2;
+    b->ops[b->count].c = 0;
+    b->count++;
+}
+
+// Translate the straight-line code starting at entry. WT1/WT2 and
+// PC1/PC2 are folded into masks that get applied where locPtr or
+// tmpPcPtr is next used, NOPs disappear, and common pairs become
+// one op. The block ends at the first JMP.
+static void TranslateBlock(Machine* m, uint8_t entry) {
+    Block* b = &m->blocks[entry];
+    uint8_t locKeep = 0xFF, locSet = 0;
+    uint8_t tmpKeep = 0xFF, tmpSet = 0;
+    uint8_t pc = entry;
+    int length = 0;
+    b->count = 0;
+    b->endsInJmp = false;
+
+    // Every instruction emits at most one op
+    while (length < 255 && b->count < BLOCK_MAX_OPS) {
+        DecodedOp insn = m->code[pc];
+        BlockOp* last = b->count > 0 ? &b->ops[b->count-1] : NULL;
+        length++;
+        pc++;
+        switch(insn.op) {
+            case OP_NOP:
+                break;
+            case OP_ADD:
+                EmitOp(b, BOP_ADD, 0, 0);
+                break;
+            case OP_SUB:
+                EmitOp(b, BOP_SUB, 0, 0);
+                break;
+            case OP_WT1:
+                locKeep &= 0x0F;
+                locSet = (locSet & 0x0F) | (insn.imm << 4);
+                break;
+            case OP_WT2:
+                locKeep &= 0xF0;
+                locSet = (locSet & 0xF0) | insn.imm;
+                break;
+            case OP_WTX:
+                if (last && (last->kind == BOP_SETY || last->kind == BOP_SETXY)) {
+                    uint8_t y = last->kind == BOP_SETY ? last->a : last->b;
+                    last->kind = BOP_SETXY;
+                    last->a = insn.imm;
+                    last->b = y;
+                } else {
+                    EmitOp(b, BOP_SETX, insn.imm, 0);
+                }
+                break;
+            case OP_WTY:
+                if (last && (last->kind == BOP_SETX || last->kind == BOP_SETXY)) {
+                    last->kind = BOP_SETXY;
+                    last->b = insn.imm;
+                } else {
+                    EmitOp(b, BOP_SETY, insn.imm, 0);
+                }
+                break;
+            case OP_WTZ:
+                EmitOp(b, BOP_SETZ, insn.imm, 0);
+                break;
+            case OP_ZTR:
+                // ADD/SUB straight into ram
+                if (last && (last->kind == BOP_ADD || last->kind == BOP_SUB)) {
+                    last->kind = last->kind == BOP_ADD ? BOP_ADDST : BOP_SUBST;
+                    last->a = locKeep;
+                    last->b = locSet;
+                } else if (last && last->kind == BOP_SETZ) {
+                    last->kind = BOP_STI;
+                    last->c = last->a;
+                    last->a = locKeep;
+                    last->b = locSet;
+                } else {
+                    EmitOp(b, BOP_ST, locKeep, locSet);
+                }
+                locKeep = 0xFF;
+                locSet = 0;
+                break;
+            case OP_RTZ:
+            case OP_RTX:
+            case OP_RTY:
+                EmitOp(b, insn.op == OP_RTZ ? BOP_LDZ : insn.op == OP_RTX ? BOP_LDX : BOP_LDY, locKeep, locSet);
+                locKeep = 0xFF;
+                locSet = 0;
+                break;
+            case OP_PC1:
+                tmpKeep &= 0xF0;
+                tmpSet = (tmpSet & 0xF0) | insn.imm;
+                break;
+            case OP_PC2:
+                tmpKeep &= 0x0F;
+                tmpSet = (tmpSet & 0x0F) | (insn.imm << 4);
+                break;
+            case OP_JMP:
+                b->endsInJmp = true;
+                break;
+            case OP_USC:
+                EmitOp(b, BOP_USC, 0, 0);
+                break;
+        }
+        // Stop at the JMP or once the whole rom has been covered
+        if (b->endsInJmp || pc == entry)
+            break;
+    }
+
+    b->length = length;
+    b->locKeep = locKeep;
+    b->locSet = locSet;
+    b->tmpKeep = tmpKeep;
+    b->tmpSet = tmpSet;
+    b->valid = true;
+}
+
+// Block ops use the same kind of dispatch as the interpreter
+#ifdef PBPU_THREADED
+#define OP_CASE(kind) op_##kind
+#define DISPATCH_OP() goto *blockHandlers[op->kind]
+#else
+#define OP_CASE(kind) case kind
+#define DISPATCH_OP() goto dispatch_op
+#endif
+// Go to the next op, or leave the block after its last one
+#define NEXT_OP() \
+    do { \
+        if (++op == end) goto block_end; \
+        DISPATCH_OP(); \
+    } while (0)
+
+// Run whole translated blocks, a block that doesn't fit
+// into what is left of the budget goes to the interpreter
+NO_CROSSJUMPING
+static StopReason RunBlocks(Machine* m, uint64_t maxCycles) {
+#ifdef PBPU_THREADED
+    static const void* const blockHandlers[] = {
+        [BOP_SETX] = &&op_BOP_SETX, [BOP_SETY] = &&op_BOP_SETY,
+        [BOP_SETXY] = &&op_BOP_SETXY, [BOP_SETZ] = &&op_BOP_SETZ,
+        [BOP_ADD] = &&op_BOP_ADD, [BOP_SUB] = &&op_BOP_SUB,
+        [BOP_ADDST] = &&op_BOP_ADDST, [BOP_SUBST] = &&op_BOP_SUBST,
+        [BOP_ST] = &&op_BOP_ST, [BOP_STI] = &&op_BOP_STI,
+        [BOP_LDZ] = &&op_BOP_LDZ, [BOP_LDX] = &&op_BOP_LDX,
+        [BOP_LDY] = &&op_BOP_LDY, [BOP_USC] = &&op_BOP_USC
+    };
+#endif
+    uint8_t* ram = m->ram;
+    uint8_t pcPtr = m->pcPtr;
+    uint8_t tmpPcPtr = m->tmpPcPtr;
+    uint8_t locPtr = m->locPtr;
+    uint8_t regX = m->regX, regY = m->regY, regZ = m->regZ;
+    bool useCarry = m->useCarry;
+    bool carry = m->carry;
+    bool ramDirty = false, screenDirty = false;
+    bool stored = m->storedSinceJump;
+    StopReason reason = STOP_BUDGET;
+    uint64_t executed = 0;
+
+    while (true) {
+        Block* b = &m->blocks[pcPtr];
+        if (!b->valid)
+            TranslateBlock(m, pcPtr);
+        if (b->length > maxCycles - executed)
+            break;
+
+        const BlockOp* op = b->ops;
+        const BlockOp* end = b->ops + b->count;
+        if (op == end)
+            goto block_end;
+#ifdef PBPU_THREADED
+        DISPATCH_OP();
+#else
+    dispatch_op:
+        switch(op->kind) {
+#endif
+        OP_CASE(BOP_SETX):
+            regX = op->a;
+            NEXT_OP();
+        OP_CASE(BOP_SETY):
+            regY = op->a;
+            NEXT_OP();
+        OP_CASE(BOP_SETXY):
+            regX = op->a;
+            regY = op->b;
+            NEXT_OP();
+        OP_CASE(BOP_SETZ):
+            regZ = op->a;
+            NEXT_OP();
+        OP_CASE(BOP_ADD):
+            DO_ADD();
+            NEXT_OP();
+        OP_CASE(BOP_ADDST):
+            DO_ADD();
+            goto store;
+        OP_CASE(BOP_SUB):
+            DO_SUB();
+            NEXT_OP();
+        OP_CASE(BOP_SUBST):
+            DO_SUB();
+            goto store;
+        OP_CASE(BOP_STI):
+            regZ = op->c;
+            goto store;
+        OP_CASE(BOP_ST):
+        store:
+            locPtr = (locPtr & op->a) | op->b;
+            RamWrite(ram, locPtr, regZ);
+            ramDirty = stored = true;
+            screenDirty |= locPtr < 4;
+            NEXT_OP();
+        OP_CASE(BOP_LDZ):
+            locPtr = (locPtr & op->a) | op->b;
+            regZ = RamRead(ram, locPtr);
+            NEXT_OP();
+        OP_CASE(BOP_LDX):
+            locPtr = (locPtr & op->a) | op->b;
+            regX = RamRead(ram, locPtr);
+            NEXT_OP();
+        OP_CASE(BOP_LDY):
+            locPtr = (locPtr & op->a) | op->b;
+            regY = RamRead(ram, locPtr);
+            NEXT_OP();
+        OP_CASE(BOP_USC):
+            useCarry = !useCarry;
+            NEXT_OP();
+#ifndef PBPU_THREADED
+        }
+#endif
+
+    block_end:
+        locPtr = (locPtr & b->locKeep) | b->locSet;
+        tmpPcPtr = (tmpPcPtr & b->tmpKeep) | b->tmpSet;
+        executed += b->length;
+
+        // Only perform JMP if Z is 0
+        if (b->endsInJmp && regZ == 0x0) {
+            bool halt = JumpHalts(m, JUMP_STATE((uint8_t)(pcPtr + b->length - 1)), &stored);
+            pcPtr = tmpPcPtr;
+            if (halt) {
+                reason = STOP_HALT;
+                break;
+            }
+        } else {
+            pcPtr += b->length;
+        }
+    }
+
+    m->pcPtr = pcPtr;
+    m->tmpPcPtr = tmpPcPtr;
+    m->locPtr = locPtr;
+    m->regX = regX;
+    m->regY = regY;
+    m->regZ = regZ;
+    m->useCarry = useCarry;
+    m->carry = carry;
+    m->cycles += executed;
+    m->ramDirty |= ramDirty;
+    m->storedSinceJump = stored;
+    m->screenDirty |= screenDirty;
+    if (reason == STOP_BUDGET && executed < maxCycles)
+        return Interpret(m, maxCycles - executed);
+    return reason;
+}
+
+#undef OP_CASE
+#undef DISPATCH_OP
+#undef NEXT_OP
+
+// Run blocks as native code. Compiled blocks jump straight into each
+// other with the registers kept in host registers, C only gets control
+// back to compile the next block or finish the budget.
+static StopReason RunJit(Machine* m, uint64_t maxCycles) {
+    uint64_t executed = 0;
+    while (true) {
+        uint8_t pcPtr = m->pcPtr;
+        Block* b = &m->blocks[pcPtr];
+        if (!b->valid)
+            TranslateBlock(m, pcPtr);
+        if (b->length > maxCycles - executed)
+            break;
+
+        if (!JitCompile(m, pcPtr)) {
+            // The interpreter runs exactly this block instead
+            executed += b->length;
+            StopReason reason = Interpret(m, b->length);
+            if (reason != STOP_BUDGET)
+                return reason;
+            continue;
+        }
+        // Runs on until it reaches a block that isn't compiled yet
+        bool halted;
+        uint64_t ran = JitRun(m, maxCycles - executed, &halted);
+        executed += ran;
+        m->cycles += ran;
+        if (halted)
+            return STOP_HALT;
+    }
+    if (executed < maxCycles)
+        return Interpret(m, maxCycles - executed);
+    return STOP_BUDGET;
+}
+
+static StopReason RunEngine(Machine* m, uint64_t maxCycles) {
+    // Blocks can't stop halfway, fine grained stops need the interpreter
+    if (m->breakpointCount > 0 || m->breakOnScreen || m->engine == ENGINE_INTERPRETER)
+        return Interpret(m, maxCycles);
+    // Compiled code doesn't count its jumps
+    if (m->engine == ENGINE_JIT && m->profile == NULL)
+        return RunJit(m, maxCycles);
+    return RunBlocks(m, maxCycles);
+}
+
+// Run up to maxCycles steps in one go
+StopReason SimRun(Machine* m, uint64_t maxCycles) {
+    if (m->profile != NULL)
+        return RunProfiled(m, maxCycles, RunEngine);
+    return RunEngine(m, maxCycles);
+}
+
+// Readable name of a stop reason
+const char* StopReasonName(StopReason reason) {
+    switch(reason) {
+        case STOP_BUDGET: return "budget exhausted";
+        case STOP_HALT: return "halted";
+        case STOP_BREAKPOINT: return "breakpoint";
+        case STOP_SCREEN: return "screen write";
+        case STOP_LOOP: return "loop";
+    }
+    return "unknown";
+}
+
+// Print registers, memory and the screen as text
+void PrintState(const Machine* m, StopReason reason, FILE* out) {
+    fprintf(out, "Cycles: %llu (%s)\n", (unsigned long long)m->cycles, StopReasonName(reason));
+    fprintf(out, "X[%01X]  Y[%01X]  Z[%01X]\n", m->regX, m->regY, m->regZ);
+    fprintf(out, "C[%c]  LC[%02X]\n", m->useCarry ? m->carry ? '1' : '0' : '-', m->locPtr);
+    fprintf(out, "pc[%02X] -> PC[%02X]\n", m->tmpPcPtr, m->pcPtr);
+    fprintf(out, "Memory:\n");
+    for (int addr = 0; addr < (int)sizeof(m->ram)*2; addr += 16) {
+        fprintf(out, "%02X: ", addr);
+        for (int col = 0; col < 16; col++) {
+            fprintf(out, "%01X ", ReadNibble(m, addr + col));
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "Screen:\n");
+    for (uint8_t row = 0; row < 4; row++) {
+        uint8_t rowVal = ReadNibble(m, row);
+        for (uint8_t col = 0; col < 4; col++) {
+            fputc((rowVal >> (3 - col)) & 0x1 ? '#' : '.', out);
+        }
+        fputc('\n', out);
+    }
+}
+
+// Set or clear a breakpoint on a rom address
+void SetBreakpoint(Machine* m, uint8_t addr, bool enabled) {
+    if (m->breakpoints[addr] == enabled) return;
+    m->breakpoints[addr] = enabled;
+    m->breakpointCount += enabled ? 1 : -1;
+    m->handlersValid = false;
+}
+
+// Stop SimRun after every write to screen memory
+void SetBreakOnScreen(Machine* m, bool enabled) {
+    m->breakOnScreen = enabled;
+}
+
+// Choose how SimRun executes code
+void SetEngine(Machine* m, Engine engine) {
+    m->engine = engine;
+}
+
+// Count executions into profile, NULL stops counting
+void SetProfile(Machine* m, struct Profile* profile) {
+    m->profile = profile;
+}
+
+// Counters in use, NULL if not profiling
+struct Profile* GetProfile(const Machine* m) {
+    return m->profile;
+}
+
+// Instructions executed since reset
+uint64_t GetCycles(const Machine* m) {
+    return m->cycles;
+}
@@ -0,0 +1,130 @@
+#ifndef LIBPBPU_H
+#define LIBPBPU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Version of the libpbpu API, bumped on incompatible changes to the
+// functions and MachineState
+#define LIBPBPU_VERSION 2
+
+// How SimRun executes code
+typedef enum {
+    ENGINE_BLOCKS,      // Cached translated blocks, the interpreter covers the rest
+    ENGINE_INTERPRETER, // One dispatch per instruction
+    ENGINE_JIT          // Blocks compiled to x86-64 code, see jit.h
+} Engine;
+
+// Registers right after a taken JMP, compared with the next pass of
+// the same loop to spot a fixed point
+typedef struct {
+    // Address of the JMP
+    uint8_t jmpPc;
+    uint8_t tmpPcPtr;
+    uint8_t locPtr;
+    uint8_t regX, regY, regZ;
+    bool useCarry;
+    bool carry;
+} JumpState;
+
+// One PBPU. The layout is private to libpbpu, see pbpu_internal.h,
+// programs using the library go through the functions below.
+typedef struct Machine Machine;
+
+// Why SimRun returned
+typedef enum {
+    STOP_BUDGET,     // maxCycles steps were executed
+    STOP_HALT,       // a loop reached a fixed point, nothing will change anymore
+    STOP_BREAKPOINT, // pcPtr reached a breakpoint
+    STOP_SCREEN,     // ZTR wrote to screen memory, only after SetBreakOnScreen
+    STOP_LOOP        // caught in a loop, only from RunDetectLoop in loop.h
+} StopReason;
+
+// Architectural state, used to move state in and out of a machine
+typedef struct {
+    uint8_t rom[256];
+    uint8_t ram[128];
+    uint8_t pcPtr;
+    uint8_t tmpPcPtr;
+    uint8_t locPtr;
+    uint8_t regX, regY, regZ;
+    bool useCarry;
+    bool carry;
+    uint64_t cycles;
+} MachineState;
+
+// Opcode enum
+enum Opcodes {
+    OP_NOP, // -
+    OP_ADD, // Z = X + Y
+    OP_SUB, // Z = X - Y
+    OP_WT1, // locPtr = (locPtr & 0x0F) | ((val & 0xF) << 4)
+    OP_WT2, // locPtr = (locPtr & 0xF0) | (val & 0xF)
+    OP_WTX, // X = val
+    OP_WTY, // Y = val
+    OP_WTZ, // Z = val
+    OP_ZTR, // ram[locPtr] = Z
+    OP_RTZ, // Z = ram[locPtr]
+    OP_PC1, // tmpPcPtr = (tmpPcPtr & 0x0F) | ((val & 0xF) << 4)
+    OP_PC2, // tmpPcPtr = (tmpPcPtr & 0xF0) | (val & 0xF)
+    OP_JMP, // pcPtr = tmpPcPtr
+    OP_RTX, // ram[locPtr] = X
+    OP_RTY, // ram[locPtr] = Y
+    OP_USC  // useCarry = !useCarry
+};
+
+// Allocate a machine in its power-on state, NULL on failure
+Machine* CreateMachine(void);
+// Free a machine from CreateMachine
+void DestroyMachine(Machine* m);
+// Reset registers and ram, keeps the loaded program
+void ResetMachine(Machine* m);
+
+// Copy a program into rom, returns the number of bytes loaded
+size_t LoadRom(Machine* m, const uint8_t* data, size_t size);
+// Load a program file into rom, returns bytes read or -1 if it can't be opened
+long LoadRomFile(Machine* m, const char* path);
+// Change one rom byte and re-decode it
+void PatchRom(Machine* m, uint8_t addr, uint8_t val);
+
+// Perform a single simulation step
+void SimStep(Machine* m);
+// Run up to maxCycles steps in one go, see StopReason for early stops.
+// GetCycles tells how far it got.
+StopReason SimRun(Machine* m, uint64_t maxCycles);
+// Readable name of a stop reason
+const char* StopReasonName(StopReason reason);
+// Print registers, memory and the screen as text
+void PrintState(const Machine* m, StopReason reason, FILE* out);
+// Set or clear a breakpoint on a rom address
+void SetBreakpoint(Machine* m, uint8_t addr, bool enabled);
+// Stop SimRun after every write to screen memory
+void SetBreakOnScreen(Machine* m, bool enabled);
+// Choose how SimRun executes code, ENGINE_BLOCKS after CreateMachine.
+// Blocks are only used without breakpoints or SetBreakOnScreen.
+void SetEngine(Machine* m, Engine engine);
+// Count executions while profile isn't NULL, see profile.h
+struct Profile;
+void SetProfile(Machine* m, struct Profile* profile);
+struct Profile* GetProfile(const Machine* m);
+// Instructions executed since reset
+uint64_t GetCycles(const Machine* m);
+
+// Copy the architectural state out of a machine
+void GetState(const Machine* m, MachineState* state);
+// Replace the architectural state of a machine
+void SetState(Machine* m, const MachineState* state);
+
+// Read a 4-Bit value from ram
+uint8_t ReadNibble(const Machine* m, uint8_t addr);
+// Write a 4-Bit value to ram, a loop waiting for it reads it before
+// halt detection can stop it
+void WriteNibble(Machine* m, uint8_t addr, uint8_t val);
+// Mnemonic of the instruction at addr
+const char* DecodeOpCode(const uint8_t* buff, int addr);
+// Mnemonic of an opcode
+const char* OpCodeName(uint8_t op);
+
+#endif
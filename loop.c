@@ -0,0 +1,198 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "loop.h"
+#include "pbpu_internal.h"
+
+// Cycles between two samples of the state
+#define SAMPLE_CYCLES 4096
+// Most samples remembered, 16 bytes each
+#define MAX_SAMPLES (1 << 20)
+
+// One visited state
+typedef struct {
+    uint64_t hash;
+    uint64_t cycles;
+} Sample;
+
+// Open addressing, a hash of 0 marks a free slot
+typedef struct {
+    Sample* slots;
+    size_t size;
+    size_t used;
+} SampleTable;
+
+static uint64_t Mix(uint64_t h, uint64_t v) {
+    h ^= v;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+uint64_t HashState(const Machine* m) {
+    uint64_t h = 0;
+    for (size_t i = 0; i < sizeof(m->ram); i += 8) {
+        uint64_t word;
+        memcpy(&word, m->ram + i, sizeof(word));
+        h = Mix(h, word);
+    }
+    uint64_t regs = m->pcPtr | (uint64_t)m->tmpPcPtr << 8 | (uint64_t)m->locPtr << 16
+        | (uint64_t)m->regX << 24 | (uint64_t)m->regY << 32 | (uint64_t)m->regZ << 40
+        | (uint64_t)m->useCarry << 48 | (uint64_t)m->carry << 56;
+    h = Mix(h, regs);
+    // Keep 0 free for empty slots
+    return h != 0 ? h : 1;
+}
+
+// If two machines are in the same architectural state
+static bool SameState(const Machine* a, const Machine* b) {
+    return a->pcPtr == b->pcPtr && a->tmpPcPtr == b->tmpPcPtr && a->locPtr == b->locPtr
+        && a->regX == b->regX && a->regY == b->regY && a->regZ == b->regZ
+        && a->useCarry == b->useCarry && a->carry == b->carry
+        && memcmp(a->ram, b->ram, sizeof(a->ram)) == 0;
+}
+
+// Slot of hash, or the free slot it would go into
+static Sample* Lookup(SampleTable* t, uint64_t hash) {
+    size_t i = hash & (t->size - 1);
+    while (t->slots[i].hash != 0 && t->slots[i].hash != hash)
+        i = (i + 1) & (t->size - 1);
+    return &t->slots[i];
+}
+
+// Make room for one more sample, false once the table can't grow
+static bool Reserve(SampleTable* t) {
+    if (2 * (t->used + 1) <= t->size)
+        return true;
+    size_t size = t->size ? t->size * 2 : 1024;
+    if (size > MAX_SAMPLES)
+        return false;
+    Sample* slots = calloc(size, sizeof(Sample));
+    if (slots == NULL)
+        return false;
+    SampleTable bigger = { slots, size, t->used };
+    for (size_t i = 0; i < t->size; i++) {
+        if (t->slots[i].hash != 0)
+            *Lookup(&bigger, t->slots[i].hash) = t->slots[i];
+    }
+    free(t->slots);
+    *t = bigger;
+    return true;
+}
+
+// New machine in the given state, NULL if out of memory
+static Machine* StartFrom(const MachineState* state, Engine engine) {
+    Machine* m = CreateMachine();
+    if (m == NULL)
+        return NULL;
+    SetState(m, state);
+    m->engine = engine;
+    return m;
+}
+
+// Step a copy of m until it is back in the same state, at most limit
+// cycles. That only happens if m is inside a loop, the first return
+// gives the period. 0 if it didn't come back.
+static uint64_t FindPeriod(const Machine* m, uint64_t limit) {
+    MachineState state;
+    GetState(m, &state);
+    Machine* probe = StartFrom(&state, m->engine);
+    if (probe == NULL)
+        return 0;
+    uint64_t period = 0;
+    for (uint64_t step = 1; step <= limit; step++) {
+        SimStep(probe);
+        if (SameState(probe, m)) {
+            period = step;
+            break;
+        }
+    }
+    DestroyMachine(probe);
+    return period;
+}
+
+// Run two copies period cycles apart from start until they meet, where
+// they do is the entry. Whole samples first, then single steps through
+// the last one.
+static bool FindEntry(const MachineState* start, Engine engine, uint64_t period, uint64_t* entry) {
+    Machine* a = StartFrom(start, engine);
+    Machine* b = StartFrom(start, engine);
+    bool found = false;
+    if (a != NULL && b != NULL && SimRun(b, period) == STOP_BUDGET) {
+        MachineState aState, bState;
+        while (!SameState(a, b)) {
+            GetState(a, &aState);
+            GetState(b, &bState);
+            if (SimRun(a, SAMPLE_CYCLES) != STOP_BUDGET || SimRun(b, SAMPLE_CYCLES) != STOP_BUDGET)
+                break;
+            if (SameState(a, b)) {
+                SetState(a, &aState);
+                SetState(b, &bState);
+                while (!SameState(a, b)) {
+                    SimStep(a);
+                    SimStep(b);
+                }
+            }
+        }
+        found = SameState(a, b);
+        *entry = a->cycles;
+    }
+    if (a != NULL)
+        DestroyMachine(a);
+    if (b != NULL)
+        DestroyMachine(b);
+    return found;
+}
+
+StopReason RunDetectLoop(Machine* m, uint64_t maxCycles, LoopInfo* loop) {
+    MachineState start;
+    GetState(m, &start);
+    SampleTable table = { NULL, 0, 0 };
+    StopReason reason = STOP_BUDGET;
+    uint64_t executed = 0;
+
+    while (true) {
+        uint64_t hash = HashState(m);
+        Sample* seen = table.size ? Lookup(&table, hash) : NULL;
+        if (seen != NULL && seen->hash == hash) {
+            // Equal hashes can still be different states, FindPeriod
+            // only succeeds on a real repeat
+            uint64_t period = FindPeriod(m, m->cycles - seen->cycles);
+            if (period != 0 && FindEntry(&start, m->engine, period, &loop->entry)) {
+                loop->period = period;
+                reason = STOP_LOOP;
+                break;
+            }
+            seen->cycles = m->cycles;
+        } else if (Reserve(&table)) {
+            seen = Lookup(&table, hash);
+            seen->hash = hash;
+            seen->cycles = m->cycles;
+            table.used++;
+        }
+
+        if (executed >= maxCycles)
+            break;
+        uint64_t chunk = maxCycles - executed < SAMPLE_CYCLES ? maxCycles - executed : SAMPLE_CYCLES;
+        uint64_t before = m->cycles;
+        reason = SimRun(m, chunk);
+        executed += m->cycles - before;
+        if (reason != STOP_BUDGET)
+            break;
+    }
+    free(table.slots);
+    return reason;
+}
+
+StopReason RunSkipLoops(Machine* m, uint64_t maxCycles, LoopInfo* loop) {
+    uint64_t end = m->cycles + maxCycles;
+    loop->period = 0;
+    StopReason reason = RunDetectLoop(m, maxCycles, loop);
+    if (reason != STOP_LOOP)
+        return reason;
+    // Every pass ends where it started, only the cycle count moves
+    uint64_t left = end - m->cycles;
+    m->cycles += left - left % loop->period;
+    return SimRun(m, left % loop->period);
+}
@@ -0,0 +1,30 @@
+#ifndef PBPU_LOOP_H
+#define PBPU_LOOP_H
+
+#include <stdint.h>
+
+#include "libpbpu.h"
+
+// Where a program settles into a cycle of states it never leaves
+typedef struct {
+    // Cycle count at which the first pass through the loop starts
+    uint64_t entry;
+    // Cycles per pass
+    uint64_t period;
+} LoopInfo;
+
+// Hash of the architectural state, rom and cycles are left out
+uint64_t HashState(const Machine* m);
+// Run like SimRun, but also stop with STOP_LOOP once the machine is
+// back in a state it was in before, loop tells where and how long the
+// loop is then. The state is only sampled every few thousand cycles,
+// so m stops somewhere inside the loop, as many passes in as it takes
+// for two samples to land on the same state: up to one per sampled
+// cycle for odd periods.
+StopReason RunDetectLoop(Machine* m, uint64_t maxCycles, LoopInfo* loop);
+// Run like SimRun and end in the same state, but once the machine is
+// caught in a loop skip all whole passes that still fit into the
+// budget. loop is filled in if one was found, its period is 0 if not.
+StopReason RunSkipLoops(Machine* m, uint64_t maxCycles, LoopInfo* loop);
+
+#endif
@@ -1,179 +1,179 @@
+#include <errno.h>
 #include <ncurses.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+
+#include "libpbpu.h"
+#include "emitc.h"
+#include "loop.h"
+#include "batch.h"
+#include "statefile.h"
+#include "rewind.h"
+#include "trace.h"
+#include "replay.h"
+#include "profile.h"
 
 // Screen width and height
 int scrHeight, scrWidth;
 // Disassembly window width
 int disWidth = 15;
-// If ram needs to be updated
-bool ramDirty = true;
-// If screen needs to be updated
-bool screenDirty = true;
+// Execution counts and heat colors in the disassembly
+bool heatmap = false;
+// Color pairs HEAT_PAIR+1 up to HEAT_PAIR+HEAT_LEVELS, coldest first
+#define HEAT_PAIR 1
+#define HEAT_LEVELS 5
 // Step mode
 bool stepMode = false;
-// Delay
-int delayTime = 100000;
-
-// Program memory
-uint8_t rom[256];
-// Random access memory
-uint8_t ram[128];
-// Pointer to the current instruction
-uint8_t pcPtr;
-// Temporary PC Register
-uint8_t tmpPcPtr;
-// Location Register (used for RAM access)
-uint8_t locPtr;
-// ALU Registers
-uint8_t regX, regY, regZ;
-// If carry should be used for math
-bool useCarry = false;
-bool carry;
-
-// Opcode enum
-enum Opcodes {
-    OP_NOP, // -
-    OP_ADD, // Z = X + Y
-    OP_SUB, // Z = X - Y
-    OP_WT1, // locPtr = (locPtr & 0x0F) | ((val & 0xF) << 4)
-    OP_WT2, // locPtr = (locPtr & 0xF0) | (val & 0xF)
-    OP_WTX, // X = val
-    OP_WTY, // Y = val
-    OP_WTZ, // Z = val
-    OP_ZTR, // ram[locPtr] = Z
-    OP_RTZ, // Z = ram[locPtr]
-    OP_PC1, // tmpPcPtr = (tmpPcPtr & 0x0F) | ((val & 0xF) << 4)
-    OP_PC2, // tmpPcPtr = (tmpPcPtr & 0xF0) | (val & 0xF)
-    OP_JMP, // pcPtr = tmpPcPtr
-    OP_RTX, // ram[locPtr] = X
-    OP_RTY, // ram[locPtr] = Y
-    OP_USC  // useCarry = !useCarry
-};
-
-char* DecodeOpCode(uint8_t* buff, int addr) {
-    uint8_t op = (buff[addr] & 0xF0) >> 4;
-    switch(op) {
-        case OP_NOP: return "NOP";
-        case OP_ADD: return "ADD";
-        case OP_SUB: return "SUB";
-        case OP_WT1: return "WT1";
-        case OP_WT2: return "WT2";
-        case OP_WTX: return "WTX";
-        case OP_WTY: return "WTY";
-        case OP_WTZ: return "WTZ";
-        case OP_ZTR: return "ZTR";
-        case OP_RTZ: return "RTZ";
-        case OP_PC1: return "PC1";
-        case OP_PC2: return "PC2";
-        case OP_JMP: return "JMP";
-        case OP_RTX: return "RTX";
-        case OP_RTY: return "RTY";
-        case OP_USC: return "USC";
-    }
-    return "ERR";
+// Emulated clock in instructions per second for MODE_PACED
+double clockHz = 10;
+// Range of clockHz, keeps the deadlines of the sim thread finite
+#define MIN_HZ 0.01
+#define MAX_HZ 1e12
+
+// How the sim thread runs the program, switched with keys at runtime
+typedef enum {
+    MODE_STEP,  // One instruction per key press
+    MODE_PACED, // At clockHz
+    MODE_TURBO  // As fast as possible, the display still refreshes once per frame
+} RunMode;
+RunMode runMode = MODE_PACED;
+// UI refreshes per second
+int frameRate = 30;
+// Run without ncurses
+bool headless = false;
+// Cycle budget for headless runs
+uint64_t maxCycles = 1000000;
+// Time headless runs
+bool benchMode = false;
+// Stop headless runs once the program is caught in a loop
+bool detectLoops = false;
+// Skip whole passes through loops in headless runs
+bool skipLoops = false;
+// Execution engine
+Engine engine = ENGINE_BLOCKS;
+// Compare the JIT against SimStep
+bool jitCheck = false;
+// Compare the batch engine against SimRun
+bool batchCheck = false;
+// Count executions per address in headless runs and print a report
+bool profileMode = false;
+// Compare runs resumed from a state file with a straight run
+bool stateCheck = false;
+// Run the built in ram poke test
+bool pokeCheck = false;
+// Write the program as C instead of running it
+bool emitC = false;
+// State file to start from, and one to write after headless runs
+const char* loadStatePath = NULL;
+const char* saveStatePath = NULL;
+// Trace file written by headless runs, and one to print
+const char* tracePath = NULL;
+const char* dumpTracePath = NULL;
+// Event log written by the UI, and one to replay headless
+const char* recordPath = NULL;
+const char* replayPath = NULL;
+// Open log for recordPath, owned by the sim thread
+EventLog* eventLog = NULL;
+// Memory for going back in step mode, 0 turns rewinding off
+size_t rewindKb = 1024;
+// Past states for the rewind keys, owned by the sim thread
+History* history = NULL;
+// Instructions B goes back
+#define REWIND_FAR_STEPS 1000
+
+// Triple buffer of machine states. The sim thread fills snapshotBack
+// and swaps it with the shared slot, the UI swaps snapshotFront with
+// the shared slot whenever that holds a newer state. Neither side
+// ever waits for the other.
+MachineState snapshots[3];
+// Index of the shared slot, SNAPSHOT_FRESH is set while the UI hasn't
+// taken it yet
+atomic_int snapshotShared = 1;
+#define SNAPSHOT_FRESH 4
+// Owned by the sim thread
+int snapshotBack = 0;
+// Owned by the UI
+int snapshotFront = 2;
+// Executions per rom address that go with each snapshot, only filled
+// in with --heatmap
+uint64_t snapshotCounts[3][256];
+
+// Messages from the UI to the sim thread
+typedef enum {
+    CMD_STEP,       // Run one instruction, only used in step mode
+    CMD_MODE_STEP,  // Switch to MODE_STEP
+    CMD_MODE_PACED, // Switch to MODE_PACED
+    CMD_MODE_TURBO, // Switch to MODE_TURBO
+    CMD_FASTER,     // Double clockHz
+    CMD_SLOWER,     // Halve clockHz
+    CMD_BACK,       // Go back one instruction, switches to MODE_STEP
+    CMD_BACK_FAR,   // Go back REWIND_FAR_STEPS instructions, switches to MODE_STEP
+    CMD_QUIT        // Leave the sim thread
+} Command;
+
+// Single producer, single consumer ring of commands
+#define COMMAND_QUEUE_SIZE 64
+uint8_t commandQueue[COMMAND_QUEUE_SIZE];
+atomic_uint commandHead = 0;
+atomic_uint commandTail = 0;
+
+// Publish the current state of the machine to the UI, sim thread only
+void PublishState(Machine* m) {
+    GetState(m, &snapshots[snapshotBack]);
+    if (GetProfile(m) != NULL)
+        ProfileCounts(GetProfile(m), snapshotCounts[snapshotBack]);
+    snapshotBack = atomic_exchange(&snapshotShared, snapshotBack | SNAPSHOT_FRESH) & 3;
 }
 
-// Write a 4-Bit value to the buffer
-void WriteNibble(uint8_t* buff, uint8_t addr, uint8_t val) {
-    if (addr % 2 == 0)
-        buff[addr/2] = (buff[addr/2] & 0xF0) | (val & 0x0F);
-    else
-        buff[addr/2] = (buff[addr/2] & 0x0F) | ((val & 0x0F) << 4);
+// Newest published state, UI only
+const MachineState* LatestState(void) {
+    if (atomic_load(&snapshotShared) & SNAPSHOT_FRESH)
+        snapshotFront = atomic_exchange(&snapshotShared, snapshotFront) & 3;
+    return &snapshots[snapshotFront];
 }
 
-// Read a 4-Bit value from the buffer
-uint8_t ReadNibble(uint8_t* buff, uint8_t addr) {
-    if (addr % 2 == 0)
-        return buff[addr/2] & 0x0F;
-    else
-        return (buff[addr/2] >> 4) & 0x0F;
+// Counts that go with the state LatestState returned last, UI only
+const uint64_t* LatestCounts(void) {
+    return snapshotCounts[snapshotFront];
 }
 
-// Limit registers to 4-Bit range
-void LimitRegs() {
-    regX &= 0xF;
-    regY &= 0xF;
-    regZ &= 0xF;
+// Queue a command for the sim thread, false if the queue is full
+bool SendCommand(Command cmd) {
+    unsigned head = atomic_load_explicit(&commandHead, memory_order_relaxed);
+    if (head - atomic_load_explicit(&commandTail, memory_order_acquire) == COMMAND_QUEUE_SIZE)
+        return false;
+    commandQueue[head % COMMAND_QUEUE_SIZE] = cmd;
+    atomic_store_explicit(&commandHead, head + 1, memory_order_release);
+    return true;
 }
 
-// Perform a single simulation step
-void SimStep() {
-    uint8_t op = rom[pcPtr] >> 4;
-    uint8_t imm = rom[pcPtr] & 0xF;
-    switch(op) {
-        case OP_NOP:
-            break;
-        case OP_ADD:
-            regZ = regX + regY + (useCarry ? (uint8_t)carry : 0);
-            carry = (regZ >> 4) & 0x1;
-            break;
-        // This may not be 100% accurate, due to me
-        // being unsure how logisim implements these
-        case OP_SUB: {
-            uint8_t subTmp = regY + (useCarry ? (uint8_t)carry : 0);
-            regZ = regX - subTmp;
-            carry = regX >= subTmp;
-            break;
-        }
-        case OP_WT1:
-            locPtr = (locPtr & 0x0F) | (imm << 4);
-            break;
-        case OP_WT2:
-            locPtr = (locPtr & 0xF0) | (imm);
-            break;
-        case OP_WTX:
-            regX = imm;
-            break;
-        case OP_WTY:
-            regY = imm;
-            break;
-        case OP_WTZ:
-            regZ = imm;
-            break;
-        case OP_ZTR:
-            WriteNibble(ram, locPtr, regZ);
-            screenDirty = (locPtr < 4);
-            ramDirty = true;
-            break;
-        case OP_RTZ:
-            regZ = ReadNibble(ram, locPtr);
-            break;
-        case OP_PC1:
-            tmpPcPtr = (tmpPcPtr & 0xF0) | (imm);
-            break;
-        case OP_PC2:
-            tmpPcPtr = (tmpPcPtr & 0x0F) | (imm << 4);
-            break;
-        case OP_JMP:
-            // Only perform JMP if Z is 0
-            if (regZ == 0x0) {
-                // Needs to be here due to a hardware quirk
-                pcPtr = tmpPcPtr-1;
-            }
-            break;
-        case OP_RTX:
-            regX = ReadNibble(ram, locPtr);
-            break;
-        case OP_RTY:
-            regY = ReadNibble(ram, locPtr);
-            break;
-        case OP_USC:
-            useCarry = !useCarry;
-            break;
-    }
-    LimitRegs();
-    pcPtr++;
+// Take the next command, false if there is none
+bool ReceiveCommand(Command* cmd) {
+    unsigned tail = atomic_load_explicit(&commandTail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&commandHead, memory_order_acquire))
+        return false;
+    *cmd = commandQueue[tail % COMMAND_QUEUE_SIZE];
+    atomic_store_explicit(&commandTail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Read a 4-Bit value from the ram of a snapshot
+uint8_t StateNibble(const MachineState* s, uint8_t addr) {
+    if (addr % 2 == 0)
+        return s->ram[addr/2] & 0x0F;
+    return (s->ram[addr/2] >> 4) & 0x0F;
 }
 
 // Update the 4x4 screen
-void UpdateScreen(WINDOW* win) {
-    if (!ramDirty) return;
+void UpdateScreen(WINDOW* win, const MachineState* s) {
     for (uint8_t row = 0; row < 4*2; row++) {   
         wmove(win, row+1, 2); 
-        uint8_t rowVal = ReadNibble(ram, row/2);
+        uint8_t rowVal = StateNibble(s, row/2);
         for (uint8_t col = 0; col < 4; col++) {
             if ((rowVal >> (3 - col)) & 0x1) {
                 waddnstr(win, "####", 4);
@@ -186,8 +186,30 @@ void UpdateScreen(WINDOW* win) {
     wnoutrefresh(win);
 }
 
-// Update the disassembly window
-void UpdateDisassembly(WINDOW* win) {
+// Bits needed to write val, 0 for 0
+static int BitLength(uint64_t val) {
+    return val ? 64 - __builtin_clzll(val) : 0;
+}
+
+// Execution count in at most 5 characters
+static void FormatCount(char* out, size_t size, uint64_t count) {
+    const char* units = " kMGTPE";
+    int unit = 0;
+    if (count >= 100000) {
+        while (count >= 10000) {
+            count /= 1000;
+            unit++;
+        }
+    }
+    if (unit == 0)
+        snprintf(out, size, "%llu", (unsigned long long)count);
+    else
+        snprintf(out, size, "%llu%c", (unsigned long long)count, units[unit]);
+}
+
+// Update the disassembly window, counts adds a column with the
+// executions of every address, colored by how hot it is
+void UpdateDisassembly(WINDOW* win, const MachineState* s, const uint64_t* counts) {
     // Get window size
     int y,x;
     getmaxyx(win, y, x);
@@ -197,51 +219,73 @@ void UpdateDisassembly(WINDOW* win) {
     int cursor_row = y / 2; // where the ">" is
     mvwaddch(win, cursor_row, 1, '>');
     int half_lines = (y - 2) / 2; // number of lines above/below cursor
+    // Heat is on a log scale up to the hottest address
+    int maxBits = 0;
+    if (counts != NULL) {
+        for (int addr = 0; addr < (int)sizeof(s->rom); addr++) {
+            if (BitLength(counts[addr]) > maxBits)
+                maxBits = BitLength(counts[addr]);
+        }
+    }
     for (int offset = -half_lines; offset <=half_lines; offset++) {
         int line = cursor_row + offset;
         if (line <= 0 || line >= y-1) continue;
-        int addr = pcPtr + offset;
-        if (addr < 0 || addr >= (int)sizeof(rom)) continue;
+        int addr = s->pcPtr + offset;
+        if (addr < 0 || addr >= (int)sizeof(s->rom)) continue;
 
+        int level = 0;
+        if (counts != NULL && counts[addr] > 0 && has_colors())
+            level = 1 + (HEAT_LEVELS - 1) * (BitLength(counts[addr]) - 1) / (maxBits > 1 ? maxBits - 1 : 1);
+        if (level > 0)
+            wattron(win, COLOR_PAIR(HEAT_PAIR + level - 1));
         mvwprintw(
             win,
-            line, pcPtr == addr ? 3 : 2,
+            line, s->pcPtr == addr ? 3 : 2,
             "%02X:  %s %01X",
             addr,
-            DecodeOpCode(rom, addr),
-            rom[addr] & 0xF
+            DecodeOpCode(s->rom, addr),
+            s->rom[addr] & 0xF
         );
+        if (counts != NULL) {
+            char count[8];
+            FormatCount(count, sizeof(count), counts[addr]);
+            wprintw(win, " %5s", count);
+        }
+        if (level > 0)
+            wattroff(win, COLOR_PAIR(HEAT_PAIR + level - 1));
     }
     wnoutrefresh(win);
 }
 
 // Update Register Window
-void UpdateRegisters(WINDOW* win) {
+void UpdateRegisters(WINDOW* win, const MachineState* s) {
     int y,x;
     getmaxyx(win, y, x);
     box(win, 0, 0);
     mvwaddstr(win, 0, 1, "[Registers]");
-    mvwprintw(win, 1, 2, "X[%01X]  Y[%01X]  Z[%01X]", regX, regY, regZ);
-    mvwprintw(win, 2, 2, "C[%c]      LC[%02X]", useCarry ? carry ? '1' : '0' : '-', locPtr);
-    mvwprintw(win, 3, 2, "pc[%02X] -> PC[%02X]", tmpPcPtr, pcPtr);
+    mvwprintw(win, 1, 2, "X[%01X]  Y[%01X]  Z[%01X]", s->regX, s->regY, s->regZ);
+    mvwprintw(win, 2, 2, "C[%c]      LC[%02X]", s->useCarry ? s->carry ? '1' : '0' : '-', s->locPtr);
+    mvwprintw(win, 3, 2, "pc[%02X] -> PC[%02X]", s->tmpPcPtr, s->pcPtr);
     wnoutrefresh(win);
 }
 
-// Render memory contents
-
-void UpdateMemory(WINDOW* win) {
+// Render memory contents, everything is redrawn since many writes
+// can happen between two frames
+void UpdateMemory(WINDOW* win, const MachineState* s) {
     int h, w;
     getmaxyx(win, h, w);
 
     const int bytes_per_row = 16;
     const int max_bytes = 0x100;
 
-    mvwprintw(win, 2+locPtr/bytes_per_row, 5+((locPtr%bytes_per_row)*2), "%01X", ReadNibble(ram, locPtr));
+    for (int addr = 0; addr < max_bytes && addr / bytes_per_row < h - 2; addr++) {
+        mvwprintw(win, 2+addr/bytes_per_row, 5+((addr%bytes_per_row)*2), "%01X", StateNibble(s, addr));
+    }
     wnoutrefresh(win);
 }
 
 // Init Memory
-void InitMemory(WINDOW* win) {
+void InitMemory(WINDOW* win, const MachineState* s) {
     int h, w;
     getmaxyx(win, h, w);
     box(win, 0, 0);
@@ -263,7 +307,7 @@ void InitMemory(WINDOW* win) {
             int index = addr + col;
             if (index >= max_bytes) break;
 
-            wprintw(win, "%01X ", ReadNibble(ram, addr));
+            wprintw(win, "%01X ", StateNibble(s, addr));
         }
     }
     wnoutrefresh(win);
@@ -277,21 +321,585 @@ void UpdateText(WINDOW* win) {
     wnoutrefresh(win);
 }
 
+// Show the run mode in the title of the info window
+void UpdateMode(WINDOW* win, RunMode mode) {
+    static const char* const names[] = { "Step ", "Paced", "Turbo" };
+    mvwprintw(win, 0, 1, "[%s]", names[mode]);
+    wnoutrefresh(win);
+}
+
+// Show the measured clock rate below the info text
+void UpdateRate(WINDOW* win, double hz) {
+    if (hz >= 1e6)
+        mvwprintw(win, 3, 3, "%9.2f MHz ", hz / 1e6);
+    else if (hz >= 1e3)
+        mvwprintw(win, 3, 3, "%9.2f kHz ", hz / 1e3);
+    else
+        mvwprintw(win, 3, 3, "%9.2f Hz  ", hz);
+    wnoutrefresh(win);
+}
+
+// Nanoseconds on the monotonic clock
+uint64_t NowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Sleep until a point in time from NowNs
+void SleepUntil(uint64_t deadline) {
+    struct timespec ts = { deadline / 1000000000, deadline % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+// Save the final state for --save-state and print the speed for
+// --bench, ran instructions took from start to end
+void FinishHeadless(Machine* m, uint64_t ran, struct timespec start, struct timespec end) {
+    if (saveStatePath != NULL) {
+        SavedMachine saved;
+        CaptureMachine(m, &saved);
+        StateFileResult result = SaveStateFile(&saved, saveStatePath);
+        if (result != STATE_OK)
+            printf("Saving state to %s failed: %s!\n", saveStatePath, StateFileResultName(result));
+    }
+    if (benchMode) {
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Time: %.3f s, %.2f ns/instruction, %.1f MIPS\n",
+            secs, secs * 1e9 / ran, ran / secs / 1e6);
+    }
+}
+
+// Run without any rendering until the budget is used up,
+// the program halts or, with --loops, repeats itself.
+// --skip-loops gets through the budget faster instead.
+int RunHeadless(Machine* m) {
+    TraceWriter* trace = NULL;
+    if (tracePath != NULL) {
+        trace = OpenTrace(tracePath, m);
+        if (trace == NULL) {
+            printf("Can't write trace to %s!\n", tracePath);
+            return 1;
+        }
+    }
+    Profile* profile = NULL;
+    if (profileMode) {
+        profile = CreateProfile();
+        if (profile == NULL) {
+            printf("Out of memory!\n");
+            if (trace != NULL)
+                CloseTrace(trace);
+            return 1;
+        }
+        SetProfile(m, profile);
+    }
+    uint64_t before = GetCycles(m);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    LoopInfo loop = { 0, 0 };
+    StopReason reason;
+    if (trace != NULL)
+        reason = TraceRun(trace, m, maxCycles);
+    else if (skipLoops)
+        reason = RunSkipLoops(m, maxCycles, &loop);
+    else if (detectLoops)
+        reason = RunDetectLoop(m, maxCycles, &loop);
+    else
+        reason = SimRun(m, maxCycles);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    PrintState(m, reason, stdout);
+    if (loop.period != 0) {
+        printf("Loop: %llu cycles per pass, entered at cycle %llu\n",
+            (unsigned long long)loop.period, (unsigned long long)loop.entry);
+    }
+    if (profile != NULL) {
+        MachineState state;
+        GetState(m, &state);
+        PrintProfile(profile, state.rom, stdout);
+        SetProfile(m, NULL);
+        DestroyProfile(profile);
+    }
+    if (trace != NULL) {
+        uint64_t instructions = TraceInstructions(trace);
+        uint64_t bytes = TraceBytes(trace);
+        if (!CloseTrace(trace)) {
+            printf("Writing trace to %s failed!\n", tracePath);
+            return 1;
+        }
+        printf("Trace: %llu instructions, %llu bytes, %.2f bytes/instruction\n",
+            (unsigned long long)instructions, (unsigned long long)bytes,
+            instructions ? (double)bytes / instructions : 0.0);
+    }
+    FinishHeadless(m, GetCycles(m) - before, start, end);
+    return 0;
+}
+
+// Replay an event log from --record at full speed
+int RunReplay(Machine* m) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t events, ran;
+    StopReason reason;
+    ReplayResult result = ReplayEvents(m, replayPath, &events, &ran, &reason);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (result == REPLAY_IO || result == REPLAY_FORMAT) {
+        printf("Replaying %s failed: %s!\n", replayPath, ReplayResultName(result));
+        return 1;
+    }
+    PrintState(m, reason, stdout);
+    printf("Replayed %llu events.\n", (unsigned long long)events);
+    if (result == REPLAY_DIVERGED) {
+        printf("Replay diverged from the recording at event %llu!\n", (unsigned long long)events + 1);
+        return 1;
+    }
+    FinishHeadless(m, ran, start, end);
+    return 0;
+}
+
+// Most instructions run between two looks at the command queue
+#define MAX_BATCH (1 << 20)
+// Longest nap of the sim thread, bounds the command latency
+#define MAX_NAP_NS 1000000
+
+// Runs the machine on its own thread so rendering never holds it up.
+// Pacing lives here, the UI only sees published snapshots.
+void* SimThread(void* arg) {
+    Machine* m = arg;
+    RunMode mode = runMode;
+    double hz = clockHz;
+    // Instruction n is due at startTime + n / hz. Deadlines are
+    // computed from the start, so time spent elsewhere never drifts
+    // the clock, and late instructions are caught up in batches.
+    // Switching into MODE_PACED or changing hz starts over.
+    uint64_t startTime = NowNs();
+    uint64_t paced = 0;
+    bool halted = false;
+
+    while (true) {
+        Command cmd;
+        while (ReceiveCommand(&cmd)) {
+            switch(cmd) {
+                case CMD_STEP:
+                    if (mode == MODE_STEP) {
+                        if (history != NULL)
+                            HistoryStep(history, m);
+                        else
+                            SimStep(m);
+                        PublishState(m);
+                    }
+                    break;
+                case CMD_BACK:
+                case CMD_BACK_FAR: {
+                    mode = MODE_STEP;
+                    uint64_t steps = cmd == CMD_BACK ? 1 : REWIND_FAR_STEPS;
+                    uint64_t at = GetCycles(m);
+                    if (steps > at)
+                        steps = at;
+                    if (history != NULL && Rewind(history, m, steps)) {
+                        if (eventLog != NULL)
+                            LogEvent(eventLog, m, EVENT_REWIND, steps, at);
+                        halted = false;
+                        PublishState(m);
+                    }
+                    break;
+                }
+                case CMD_MODE_STEP:
+                    mode = MODE_STEP;
+                    break;
+                case CMD_MODE_PACED:
+                    mode = MODE_PACED;
+                    break;
+                case CMD_MODE_TURBO:
+                    mode = MODE_TURBO;
+                    break;
+                case CMD_FASTER:
+                    hz = hz * 2 < MAX_HZ ? hz * 2 : MAX_HZ;
+                    break;
+                case CMD_SLOWER:
+                    hz = hz / 2 > MIN_HZ ? hz / 2 : MIN_HZ;
+                    break;
+                case CMD_QUIT:
+                    if (eventLog != NULL)
+                        LogEvent(eventLog, m, EVENT_END, 0, GetCycles(m));
+                    return NULL;
+            }
+            if (cmd != CMD_STEP) {
+                startTime = NowNs();
+                paced = 0;
+            }
+        }
+        if (mode == MODE_STEP || halted) {
+            // Only commands can change anything
+            SleepUntil(NowNs() + MAX_NAP_NS);
+            continue;
+        }
+
+        uint64_t batch = 100000;
+        if (mode == MODE_PACED) {
+            uint64_t now = NowNs();
+            uint64_t due = (uint64_t)((now - startTime) * hz / 1e9);
+            if (due <= paced) {
+                // Sleep only until the next instruction is due
+                uint64_t deadline = startTime + (uint64_t)((paced + 1) * 1e9 / hz);
+                SleepUntil(deadline < now + MAX_NAP_NS ? deadline : now + MAX_NAP_NS);
+                continue;
+            }
+            batch = due - paced;
+            if (batch > MAX_BATCH)
+                batch = MAX_BATCH;
+            paced += batch;
+        }
+        StopReason reason = history != NULL ? HistoryRun(history, m, batch) : SimRun(m, batch);
+        halted = reason == STOP_HALT;
+        PublishState(m);
+    }
+}
+
+// Run the program on the JIT and with SimStep side by side and compare
+// their state after every chunk. Chunk sizes keep changing so budgets
+// end in all kinds of places inside blocks.
+int RunJitCheck(Machine* m) {
+    Machine* ref = CreateMachine();
+    if (ref == NULL) {
+        printf("Out of memory!\n");
+        return 1;
+    }
+    MachineState jitState, refState;
+    // Padding has to match for memcmp
+    memset(&jitState, 0, sizeof(jitState));
+    memset(&refState, 0, sizeof(refState));
+    GetState(m, &refState);
+    SetState(ref, &refState);
+    SetEngine(m, ENGINE_JIT);
+
+    StopReason reason = STOP_BUDGET;
+    uint64_t chunk = 1;
+    while (GetCycles(m) < maxCycles && reason != STOP_HALT) {
+        if (chunk > maxCycles - GetCycles(m))
+            chunk = maxCycles - GetCycles(m);
+        reason = SimRun(m, chunk);
+        while (GetCycles(ref) < GetCycles(m))
+            SimStep(ref);
+        GetState(m, &jitState);
+        GetState(ref, &refState);
+        if (memcmp(&jitState, &refState, sizeof(jitState)) != 0) {
+            printf("JIT differs from SimStep at cycle %llu!\n", (unsigned long long)GetCycles(m));
+            printf("JIT:\n");
+            PrintState(m, reason, stdout);
+            printf("SimStep:\n");
+            PrintState(ref, reason, stdout);
+            DestroyMachine(ref);
+            return 1;
+        }
+        chunk = chunk * 3 + 1;
+        if (chunk > 100000)
+            chunk = 7;
+    }
+    printf("JIT matches SimStep for %llu cycles (%s)\n", (unsigned long long)GetCycles(m), StopReasonName(reason));
+    DestroyMachine(ref);
+    return 0;
+}
+
+// Machines run by --batch-check
+#define BATCH_CHECK_MACHINES 256
+
+// Run many copies of the program with the batch engine and each one
+// with SimRun, then compare. Copy 0 starts from reset, the others from
+// random ram and ALU registers so their paths split up.
+int RunBatchCheck(Machine* m) {
+    Batch* batch = CreateBatch(BATCH_CHECK_MACHINES);
+    MachineState* states = malloc(BATCH_CHECK_MACHINES * sizeof(MachineState));
+    if (batch == NULL || states == NULL) {
+        printf("Out of memory!\n");
+        return 1;
+    }
+    srand(1);
+    for (int i = 0; i < BATCH_CHECK_MACHINES; i++) {
+        GetState(m, &states[i]);
+        if (i > 0) {
+            for (size_t j = 0; j < sizeof(states[i].ram); j++)
+                states[i].ram[j] = rand();
+            states[i].regX = rand() & 0xF;
+            states[i].regY = rand() & 0xF;
+            states[i].regZ = rand() & 0xF;
+        }
+        BatchSetState(batch, i, &states[i]);
+    }
+    uint64_t start = NowNs();
+    BatchRun(batch, maxCycles);
+    uint64_t batchNs = NowNs() - start;
+
+    uint64_t cycles = 0, simNs = 0;
+    MachineState got, want;
+    // Padding has to match for memcmp
+    memset(&got, 0, sizeof(got));
+    memset(&want, 0, sizeof(want));
+    int failed = 0;
+    for (int i = 0; i < BATCH_CHECK_MACHINES; i++) {
+        SetState(m, &states[i]);
+        start = NowNs();
+        StopReason reason = SimRun(m, maxCycles);
+        simNs += NowNs() - start;
+        cycles += GetCycles(m);
+        GetState(m, &want);
+        BatchGetState(batch, i, &got);
+        if (memcmp(&got, &want, sizeof(got)) != 0 || BatchHalted(batch, i) != (reason == STOP_HALT)) {
+            printf("Batch differs from SimRun in machine %d!\n", i);
+            printf("SimRun:\n");
+            PrintState(m, reason, stdout);
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed) {
+        printf("Batch matches SimRun for %d machines, %llu cycles in total\n",
+            BATCH_CHECK_MACHINES, (unsigned long long)cycles);
+        printf("Batch: %.2f ns/instruction, SimRun: %.2f ns/instruction\n",
+            (double)batchNs / cycles, (double)simNs / cycles);
+    }
+    DestroyBatch(batch);
+    free(states);
+    return failed;
+}
+
+// Most points --state-check resumes from
+#define STATE_CHECK_SPLITS 1000
+
+// Run the program for --cycles steps, then again from a round trip
+// through a state file at up to STATE_CHECK_SPLITS points along the
+// way. Every resumed run has to stop at the same cycle, for the same
+// reason and in the same state.
+int RunStateCheck(Machine* m) {
+    SavedMachine start;
+    CaptureMachine(m, &start);
+    Machine* straight = CreateMachine();
+    if (straight == NULL) {
+        printf("Out of memory!\n");
+        return 1;
+    }
+    RestoreMachine(straight, &start);
+    SetEngine(straight, engine);
+    StopReason want = SimRun(straight, maxCycles);
+    MachineState wantState, gotState;
+    // Padding has to match for memcmp
+    memset(&wantState, 0, sizeof(wantState));
+    memset(&gotState, 0, sizeof(gotState));
+    GetState(straight, &wantState);
+    uint64_t length = GetCycles(straight) - start.state.cycles;
+    DestroyMachine(straight);
+
+    uint64_t every = length / STATE_CHECK_SPLITS + 1;
+    uint64_t splits = 0;
+    for (uint64_t split = 0; split < length; split += every) {
+        Machine* before = CreateMachine();
+        Machine* after = CreateMachine();
+        if (before == NULL || after == NULL) {
+            printf("Out of memory!\n");
+            if (before != NULL)
+                DestroyMachine(before);
+            if (after != NULL)
+                DestroyMachine(after);
+            return 1;
+        }
+        RestoreMachine(before, &start);
+        SetEngine(before, engine);
+        SimRun(before, split);
+        SavedMachine saved;
+        StateFile file;
+        CaptureMachine(before, &saved);
+        EncodeState(&saved, &file);
+        DecodeState(&file, sizeof(file), &saved);
+        RestoreMachine(after, &saved);
+        SetEngine(after, engine);
+        StopReason got = SimRun(after, maxCycles - split);
+        GetState(after, &gotState);
+        bool same = got == want && memcmp(&gotState, &wantState, sizeof(gotState)) == 0;
+        if (!same) {
+            printf("Resumed at cycle %llu, the run stops at cycle %llu (%s) instead of %llu (%s)!\n",
+                (unsigned long long)GetCycles(before),
+                (unsigned long long)gotState.cycles, StopReasonName(got),
+                (unsigned long long)wantState.cycles, StopReasonName(want));
+        }
+        DestroyMachine(before);
+        DestroyMachine(after);
+        if (!same)
+            return 1;
+        splits++;
+    }
+    printf("Resuming at %llu points matches the straight run to cycle %llu (%s)\n",
+        (unsigned long long)splits, (unsigned long long)wantState.cycles, StopReasonName(want));
+    return 0;
+}
+
+// Program for --poke-check: RTZ 0, PC1 0, PC2 0, JMP, a loop that runs
+// until ram[0] isn't 0 any more, like one waiting for input
+static const uint8_t pokeLoop[] = { 0x90, 0xA0, 0xB0, 0xC0 };
+
+// Poke ram in the middle of pokeLoop, on every engine. The loop has to
+// read the new value and leave instead of halting at its next JMP.
+int RunPokeCheck(void) {
+    const Engine engines[] = { ENGINE_INTERPRETER, ENGINE_BLOCKS, ENGINE_JIT };
+    const char* names[] = { "interpreter", "blocks", "JIT" };
+    int failed = 0;
+    for (int i = 0; i < 3; i++) {
+        Machine* m = CreateMachine();
+        if (m == NULL) {
+            printf("Out of memory!\n");
+            return 1;
+        }
+        LoadRom(m, pokeLoop, sizeof(pokeLoop));
+        SetEngine(m, engines[i]);
+        SimRun(m, 5);
+        WriteNibble(m, 0, 1);
+        StopReason reason = SimRun(m, 100);
+        MachineState state;
+        GetState(m, &state);
+        if (reason != STOP_BUDGET || state.regZ != 1) {
+            printf("%s: stops at cycle %llu (%s) with Z=%X before reading the poke!\n",
+                names[i], (unsigned long long)state.cycles, StopReasonName(reason), state.regZ);
+            failed = 1;
+        }
+        DestroyMachine(m);
+    }
+    if (!failed)
+        printf("A poke in the middle of a loop reaches it on every engine\n");
+    return failed;
+}
+
 // Main function
 int main(int argc, char** argv) {
     // Read other params
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--help") == 0) {
             printf("pbpu <file> [options]\n");
+            printf("pbpu --load-state=<state> [options]\n");
+            printf("pbpu --dump-trace=<trace>\n");
             printf("--help: Print help info\n");
             printf("--step: Single step mode\n");
-            printf("--delay=<num>: Delay in microseconds\n");
+            printf("--hz=<num>: Emulated clock rate in instructions per second, 0.01 to 1e12\n");
+            printf("--delay=<num>: Delay per instruction in microseconds, 0 runs at full speed\n");
+            printf("--fps=<num>: Display refreshes per second\n");
+            printf("--headless: Run without display, print final state\n");
+            printf("--cycles=<num>: Cycle budget for headless runs\n");
+            printf("--bench: Headless run that also prints emulation speed\n");
+            printf("--loops: Headless run that stops once the program repeats a state\n");
+            printf("--skip-loops: Headless run that skips whole passes through loops to reach --cycles\n");
+            printf("--interpret: Don't use the block translation cache\n");
+            printf("--jit: Compile blocks to x86-64 code\n");
+            printf("--jit-check: Compare the JIT with SimStep for --cycles steps\n");
+            printf("--batch-check: Run %d copies for --cycles steps with the batch engine and compare with SimRun\n", BATCH_CHECK_MACHINES);
+            printf("--emit-c: Print the program compiled to C\n");
+            printf("--load-state=<file>: Start from a saved state, a program file passed as well replaces its rom\n");
+            printf("--save-state=<file>: Save the final state of headless runs\n");
+            printf("--poke-check: Check that writing ram in the middle of a loop holds off its halt\n");
+            printf("--state-check: Save and resume the program at many points within --cycles and compare with a straight run\n");
+            printf("--trace=<file>: Headless run that records every instruction to a binary trace\n");
+            printf("--dump-trace=<file>: Print a trace from --trace as text\n");
+            printf("--profile: Headless run that reports the hottest addresses, opcodes and loops\n");
+            printf("--heatmap: Show how often every address ran in the disassembly, colored by heat\n");
+            printf("--record=<file>: Log everything from outside the program that changes the run, with its cycle\n");
+            printf("--replay=<file>: Headless run of a --record log at full speed, ends bit-identical to the recording\n");
+            printf("--rewind-kb=<num>: Memory for going back with b and B, 0 turns it off (default 1024)\n");
+            printf("Keys: s step mode, p paced, t turbo, +/- double/halve the paced clock, q quit.\n");
+            printf("      b/B go back 1/%d instructions and switch to step mode.\n", REWIND_FAR_STEPS);
+            printf("      Any other key runs one instruction in step mode.\n");
             return 0;
         }
         if (strcmp(argv[i], "--step") == 0) {
             stepMode = true;
         }
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        }
+        if (strcmp(argv[i], "--bench") == 0) {
+            headless = true;
+            benchMode = true;
+        }
+        if (strcmp(argv[i], "--loops") == 0) {
+            headless = true;
+            detectLoops = true;
+        }
+        if (strcmp(argv[i], "--skip-loops") == 0) {
+            headless = true;
+            skipLoops = true;
+        }
+        if (strcmp(argv[i], "--profile") == 0) {
+            headless = true;
+            profileMode = true;
+        }
+        if (strcmp(argv[i], "--heatmap") == 0) {
+            heatmap = true;
+        }
+        if (strcmp(argv[i], "--interpret") == 0) {
+            engine = ENGINE_INTERPRETER;
+        }
+        if (strcmp(argv[i], "--jit") == 0) {
+            engine = ENGINE_JIT;
+        }
+        if (strcmp(argv[i], "--jit-check") == 0) {
+            jitCheck = true;
+        }
+        if (strcmp(argv[i], "--poke-check") == 0) {
+            pokeCheck = true;
+        }
+        if (strcmp(argv[i], "--state-check") == 0) {
+            stateCheck = true;
+        }
+        if (strcmp(argv[i], "--batch-check") == 0) {
+            batchCheck = true;
+        }
+        if (strcmp(argv[i], "--emit-c") == 0) {
+            emitC = true;
+        }
+        if (strncmp(argv[i], "--load-state=", 13) == 0) {
+            loadStatePath = argv[i] + 13;
+        }
+        if (strncmp(argv[i], "--save-state=", 13) == 0) {
+            saveStatePath = argv[i] + 13;
+        }
+        if (strncmp(argv[i], "--trace=", 8) == 0) {
+            headless = true;
+            tracePath = argv[i] + 8;
+        }
+        if (strncmp(argv[i], "--dump-trace=", 13) == 0) {
+            dumpTracePath = argv[i] + 13;
+        }
+        if (strncmp(argv[i], "--record=", 9) == 0) {
+            recordPath = argv[i] + 9;
+        }
+        if (strncmp(argv[i], "--replay=", 9) == 0) {
+            replayPath = argv[i] + 9;
+        }
+        if (strncmp(argv[i], "--rewind-kb=", 12) == 0) {
+            if (sscanf(argv[i] + 12, "%zu", &rewindKb) != 1) {
+                printf("Invalid rewind memory!\n");
+                return 1;
+            }
+        }
+        if (strncmp(argv[i], "--cycles=", 9) == 0) {
+            if (sscanf(argv[i] + 9, "%llu", (unsigned long long*)&maxCycles) != 1) {
+                printf("Invalid cycle count!\n");
+                return 1;
+            }
+        }
+        if (strncmp(argv[i], "--fps=", 6) == 0) {
+            if (sscanf(argv[i] + 6, "%d", &frameRate) != 1 || frameRate <= 0) {
+                printf("Invalid frame rate!\n");
+                return 1;
+            }
+        }
+        if (strncmp(argv[i], "--hz=", 5) == 0) {
+            if (sscanf(argv[i] + 5, "%lf", &clockHz) != 1) {
+                printf("Invalid clock rate!\n");
+                return 1;
+            }
+            // Also catches nan and inf
+            if (!(clockHz >= MIN_HZ && clockHz <= MAX_HZ)) {
+                printf("Clock rate must be between 0.01 and 1e12!\n");
+                return 1;
+            }
+        }
         if (strncmp(argv[i], "--delay=", 8) == 0) {
+            int delayTime;
             if (sscanf(argv[i] + 8, "%d", &delayTime) != 1) {
                 printf("Invalid delay value!\n");
                 return 1;
@@ -300,35 +908,151 @@ int main(int argc, char** argv) {
                 printf("Delay can't be negative!\n");
                 return 1;
             }
+            if (delayTime == 0) {
+                runMode = MODE_TURBO;
+            } else {
+                clockHz = 1e6 / delayTime;
+                runMode = MODE_PACED;
+                if (clockHz < MIN_HZ) {
+                    printf("Delay can't be longer than %.0f us!\n", 1e6 / MIN_HZ);
+                    return 1;
+                }
+            }
+        }
+    }
+    if (stepMode)
+        runMode = MODE_STEP;
+    // Check if program filename has been passed in, a saved state
+    // brings its own program
+    const char* program = argc >= 2 && strncmp(argv[1], "--", 2) != 0 ? argv[1] : NULL;
+    if (pokeCheck) {
+        return RunPokeCheck();
+    }
+    // Traces hold their own start state and rom
+    if (dumpTracePath != NULL) {
+        if (!DumpTrace(dumpTracePath, stdout)) {
+            printf("Reading trace %s failed!\n", dumpTracePath);
+            return 1;
         }
+        return 0;
     }
-    // Check if program filename has been passed in
-    if (argc < 2) {
+    // So do event logs
+    if (replayPath != NULL) {
+        Machine* machine = CreateMachine();
+        if (machine == NULL) {
+            printf("Out of memory!\n");
+            return 1;
+        }
+        SetEngine(machine, engine);
+        int result = RunReplay(machine);
+        DestroyMachine(machine);
+        return result;
+    }
+    if (program == NULL && loadStatePath == NULL) {
         printf("No program passed in!\n");
         return 1;
     }
-    // Scoping these so they don't stick
-    // around in memory while we don't need them
-    {
-        FILE* prgFile;
-        prgFile = fopen(argv[1], "rb");
-        if (prgFile == NULL) {
+    Machine* machine = CreateMachine();
+    if (machine == NULL) {
+        printf("Out of memory!\n");
+        return 1;
+    }
+    SetEngine(machine, engine);
+    if (loadStatePath != NULL) {
+        SavedMachine saved;
+        StateFileResult result = LoadStateFile(&saved, loadStatePath);
+        if (result != STATE_OK) {
+            printf("Loading state from %s failed: %s!\n", loadStatePath, StateFileResultName(result));
+            return 1;
+        }
+        // Halt detection of the saved rom means nothing for a new one
+        if (program != NULL)
+            SetState(machine, &saved.state);
+        else
+            RestoreMachine(machine, &saved);
+        if (!emitC)
+            printf("Loaded state at cycle %llu.\n", (unsigned long long)saved.state.cycles);
+    }
+    if (program != NULL) {
+        // Keeps ram and registers of a loaded state
+        long readBytes = LoadRomFile(machine, program);
+        if (readBytes < 0) {
             printf("Program not found!\n");
-            fclose(prgFile);
             return 1;
         }
-        size_t readBytes = fread(rom, sizeof(uint8_t), sizeof(rom) - 1, prgFile);
-        printf("Read %zu bytes.\n", readBytes);
-        if (readBytes <= 0) {
+        // Keep stdout clean for the generated code
+        if (!emitC)
+            printf("Read %ld bytes.\n", readBytes);
+        if (readBytes == 0) {
             printf("Program is empty!\n");
-            fclose(prgFile);
             return 1;
         }
-        fclose(prgFile);
     }
 
+    if (emitC) {
+        if (!EmitC(machine, program != NULL ? program : loadStatePath, stdout)) {
+            fprintf(stderr, "Writing C failed!\n");
+            return 1;
+        }
+        return 0;
+    }
+    if (jitCheck) {
+        return RunJitCheck(machine);
+    }
+    if (batchCheck) {
+        return RunBatchCheck(machine);
+    }
+    if (stateCheck) {
+        return RunStateCheck(machine);
+    }
+    if (headless && recordPath != NULL) {
+        printf("Headless runs have nothing to record!\n");
+        return 1;
+    }
+    if (headless) {
+        return RunHeadless(machine);
+    }
+
+    if (rewindKb > 0) {
+        history = CreateHistory(rewindKb * 1024);
+        if (history == NULL) {
+            printf("Can't set up rewinding with %zu KiB!\n", rewindKb);
+            return 1;
+        }
+        ResetHistory(history, machine);
+    }
+    if (recordPath != NULL) {
+        eventLog = OpenEventLog(recordPath, machine, rewindKb);
+        if (eventLog == NULL) {
+            printf("Can't record events to %s!\n", recordPath);
+            return 1;
+        }
+    }
+
+    Profile* profile = NULL;
+    if (heatmap) {
+        profile = CreateProfile();
+        if (profile == NULL) {
+            printf("Out of memory!\n");
+            return 1;
+        }
+        SetProfile(machine, profile);
+        // Room for the counts
+        disWidth += 6;
+    }
+
+    // The UI starts with the state as loaded
+    GetState(machine, &snapshots[snapshotFront]);
+
     // Init ncurses window
     initscr();
+    if (heatmap && has_colors()) {
+        start_color();
+        use_default_colors();
+        const short heat[HEAT_LEVELS] = { COLOR_BLUE, COLOR_CYAN, COLOR_GREEN, COLOR_YELLOW, COLOR_RED };
+        for (int i = 0; i < HEAT_LEVELS; i++)
+            init_pair(HEAT_PAIR + i, heat[i], -1);
+    }
 
     getmaxyx(stdscr, scrHeight, scrWidth);
 
@@ -337,44 +1061,128 @@ int main(int argc, char** argv) {
     WINDOW* scrWin = newwin(4*2+2,4*4+2+2,5,0);
     WINDOW* memWin = newwin(scrHeight, 0xF*2 + 8, 0, 20);
     WINDOW* disWin = newwin(scrHeight,disWidth,0, 20 + 0xF*2 + 8);
-    WINDOW* texWin = newwin(4, 20, scrHeight-4, 0);
+    WINDOW* texWin = newwin(5, 20, scrHeight-5, 0);
     // Only needs to be rendered once
-    InitMemory(memWin);
+    InitMemory(memWin, LatestState());
     UpdateText(texWin);
 
     noecho();
     cbreak();
-    if (!stepMode)
-        nodelay(stdscr, TRUE);
+    // Keys are read once per frame and turned into commands
+    nodelay(stdscr, TRUE);
     keypad(stdscr, TRUE);
     idlok(stdscr, TRUE);
     idcok(stdscr, TRUE);
     curs_set(0);
 
+    pthread_t simThread;
+    if (pthread_create(&simThread, NULL, SimThread, machine) != 0) {
+        endwin();
+        printf("Can't start the simulation thread!\n");
+        return 1;
+    }
+
+    // The display shows the latest state once per frame
+    uint64_t frameTime = 1000000000 / frameRate;
+    uint64_t nextFrame = NowNs();
+    // Mode as last requested, the sim thread switches on the command
+    RunMode uiMode = runMode;
+    // Where the last rate measurement started
+    uint64_t rateTime = nextFrame;
+    uint64_t rateCycles = GetCycles(machine);
+    // Ram as drawn last, the screen and memory only change with it
+    uint8_t shownRam[sizeof(snapshots[0].ram)];
+    bool firstFrame = true;
+
     // Main program look
     while(true) {
+        bool quit = false;
+        int key;
+        while ((key = getch()) != ERR) {
+            switch(key) {
+                case 'q':
+                    quit = true;
+                    break;
+                case 's':
+                    SendCommand(CMD_MODE_STEP);
+                    uiMode = MODE_STEP;
+                    break;
+                case 'p':
+                    SendCommand(CMD_MODE_PACED);
+                    uiMode = MODE_PACED;
+                    break;
+                case 't':
+                    SendCommand(CMD_MODE_TURBO);
+                    uiMode = MODE_TURBO;
+                    break;
+                case '+':
+                    SendCommand(CMD_FASTER);
+                    break;
+                case '-':
+                    SendCommand(CMD_SLOWER);
+                    break;
+                case 'b':
+                    SendCommand(CMD_BACK);
+                    uiMode = MODE_STEP;
+                    break;
+                case 'B':
+                    SendCommand(CMD_BACK_FAR);
+                    uiMode = MODE_STEP;
+                    break;
+                case KEY_RESIZE:
+                    break;
+                default:
+                    if (uiMode == MODE_STEP)
+                        SendCommand(CMD_STEP);
+                    break;
+            }
+        }
+        if (quit)
+            break;
 
-        UpdateDisassembly(disWin);
-        UpdateRegisters(regWin);
-        if (screenDirty) {
-            UpdateScreen(scrWin);
-            screenDirty = false;
+        const MachineState* state = LatestState();
+        UpdateMode(texWin, uiMode);
+        UpdateDisassembly(disWin, state, heatmap ? LatestCounts() : NULL);
+        UpdateRegisters(regWin, state);
+        if (firstFrame || memcmp(shownRam, state->ram, sizeof(shownRam)) != 0) {
+            UpdateScreen(scrWin, state);
+            UpdateMemory(memWin, state);
+            memcpy(shownRam, state->ram, sizeof(shownRam));
+            firstFrame = false;
         }
-        if (ramDirty) {
-            UpdateMemory(memWin);
-            ramDirty = false;
+        uint64_t now = NowNs();
+        // Going back starts the measurement over
+        if (state->cycles < rateCycles) {
+            rateTime = now;
+            rateCycles = state->cycles;
         }
-        doupdate();
-
-        if (!stepMode) {
-            usleep(delayTime);
-        } else {
-            getch();
+        if (now - rateTime >= 1000000000) {
+            UpdateRate(texWin, (state->cycles - rateCycles) * 1e9 / (now - rateTime));
+            rateTime = now;
+            rateCycles = state->cycles;
         }
+        doupdate();
 
-        SimStep();
+        nextFrame += frameTime;
+        if (nextFrame > now)
+            SleepUntil(nextFrame);
+        else
+            // Don't try to catch up on frames that were missed
+            nextFrame = now;
     }
+    while (!SendCommand(CMD_QUIT))
+        SleepUntil(NowNs() + MAX_NAP_NS);
+    pthread_join(simThread, NULL);
+    DestroyMachine(machine);
+    if (history != NULL)
+        DestroyHistory(history);
+    if (profile != NULL)
+        DestroyProfile(profile);
     delwin(scrWin);
     endwin();
+    if (eventLog != NULL && !CloseEventLog(eventLog)) {
+        printf("Writing events to %s failed!\n", recordPath);
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file
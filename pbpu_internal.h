@@ -0,0 +1,105 @@
+#ifndef PBPU_INTERNAL_H
+#define PBPU_INTERNAL_H
+
+// Layout of Machine and the block cache, shared by the modules of
+// libpbpu. Only code built together with libpbpu.c may include this.
+
+#include "libpbpu.h"
+
+// Predecoded rom slot
+typedef struct {
+    // Handler address used by the threaded interpreter
+    const void* handler;
+    uint8_t op;
+    uint8_t imm;
+} DecodedOp;
+
+// Most ops one translated block can hold
+#define BLOCK_MAX_OPS 32
+
+// Block op kinds, most of them stand for several instructions
+enum BlockOps {
+    BOP_SETX,  // X = a
+    BOP_SETY,  // Y = a
+    BOP_SETXY, // X = a, Y = b (WTX/WTY pair)
+    BOP_SETZ,  // Z = a
+    BOP_ADD,   // Z = X + Y
+    BOP_SUB,   // Z = X - Y
+    BOP_ADDST, // ADD, then the ZTR below
+    BOP_SUBST, // SUB, then the ZTR below
+    BOP_ST,    // locPtr = (locPtr & a) | b, ram[locPtr] = Z
+    BOP_STI,   // Z = c, then the ZTR above (WTZ/ZTR pair)
+    BOP_LDZ,   // locPtr = (locPtr & a) | b, Z = ram[locPtr]
+    BOP_LDX,   // locPtr = (locPtr & a) | b, X = ram[locPtr]
+    BOP_LDY,   // locPtr = (locPtr & a) | b, Y = ram[locPtr]
+    BOP_USC    // useCarry = !useCarry
+};
+
+// One op of a translated block
+typedef struct {
+    uint8_t kind;
+    uint8_t a, b, c;
+} BlockOp;
+
+// Straight-line code from one entry pc up to and including a JMP
+typedef struct {
+    bool valid;
+    // Instructions covered, each one is still charged a cycle
+    uint8_t length;
+    // Ops in use
+    uint8_t count;
+    // If the last instruction is a JMP
+    bool endsInJmp;
+    // WT1/WT2 and PC1/PC2 writes still pending at the end of the block
+    uint8_t locKeep, locSet;
+    uint8_t tmpKeep, tmpSet;
+    BlockOp ops[BLOCK_MAX_OPS];
+} Block;
+
+// Complete state of one PBPU
+struct Machine {
+    // Program memory, change it through PatchRom
+    uint8_t rom[256];
+    // rom split into opcode and operand once at load time
+    DecodedOp code[256];
+    // If the handler addresses in code are up to date
+    bool handlersValid;
+    // Random access memory
+    uint8_t ram[128];
+    // Pointer to the current instruction
+    uint8_t pcPtr;
+    // Temporary PC Register
+    uint8_t tmpPcPtr;
+    // Location Register (used for RAM access)
+    uint8_t locPtr;
+    // ALU Registers
+    uint8_t regX, regY, regZ;
+    // If carry should be used for math
+    bool useCarry;
+    bool carry;
+    // Instructions executed since reset
+    uint64_t cycles;
+    // If ram needs to be updated
+    bool ramDirty;
+    // If screen needs to be updated
+    bool screenDirty;
+    // State after the last taken JMP and if ram was written since, every
+    // engine keeps them up to date
+    JumpState lastJump;
+    bool storedSinceJump;
+    // Stop SimRun when pcPtr reaches one of these addresses
+    bool breakpoints[256];
+    int breakpointCount;
+    // Stop SimRun after every write to screen memory
+    bool breakOnScreen;
+    // Execution engine, blocks are only used without breakpoints or breakOnScreen
+    Engine engine;
+    // Translated blocks by entry pc
+    Block blocks[256];
+    // Native code for the blocks, see jit.c
+    struct JitCache* jit;
+    // Execution counters while profiling, see profile.h, NULL otherwise
+    struct Profile* profile;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "profile.h"
+
+// Lines per section of the report
+#define HOT_SPOTS 16
+#define HOT_LOOPS 8
+
+// One line of a report section before sorting
+typedef struct {
+    uint64_t count;
+    // Address, opcode or the JMP of a loop
+    int key;
+} Ranked;
+
+Profile* CreateProfile(void) {
+    return calloc(1, sizeof(Profile));
+}
+
+void DestroyProfile(Profile* p) {
+    free(p);
+}
+
+void ProfileCounts(const Profile* p, uint64_t counts[256]) {
+    // count[a] = count[a-1] - jumps[a-1] + entries[a] - exits[a] fixes
+    // every count relative to count[0], and all of them add up to the
+    // instructions executed
+    int64_t relative[256];
+    int64_t sum = 0;
+    relative[0] = 0;
+    for (int a = 1; a < 256; a++) {
+        relative[a] = relative[a - 1] - (int64_t)p->jumps[a - 1]
+            + (int64_t)p->entries[a] - (int64_t)p->exits[a];
+        sum += relative[a];
+    }
+    int64_t first = ((int64_t)p->cycles - sum) / 256;
+    for (int a = 0; a < 256; a++)
+        counts[a] = first + relative[a];
+}
+
+// Highest count first, then lowest key
+static int CompareRanked(const void* a, const void* b) {
+    const Ranked* x = a;
+    const Ranked* y = b;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->key - y->key;
+}
+
+static double Percent(uint64_t count, uint64_t total) {
+    return total ? 100.0 * count / total : 0.0;
+}
+
+void PrintProfile(const Profile* p, const uint8_t* rom, FILE* out) {
+    uint64_t counts[256];
+    ProfileCounts(p, counts);
+    uint64_t total = p->cycles;
+    fprintf(out, "Profile: %llu instructions\n", (unsigned long long)total);
+
+    Ranked ranked[256];
+    for (int a = 0; a < 256; a++)
+        ranked[a] = (Ranked){ counts[a], a };
+    qsort(ranked, 256, sizeof(Ranked), CompareRanked);
+    fprintf(out, "Hot spots:\n");
+    for (int i = 0; i < HOT_SPOTS && ranked[i].count > 0; i++) {
+        int a = ranked[i].key;
+        fprintf(out, "  %02X  %s %01X  %14llu  %5.1f%%\n", a, DecodeOpCode(rom, a), rom[a] & 0xF,
+            (unsigned long long)ranked[i].count, Percent(ranked[i].count, total));
+    }
+
+    Ranked ops[16];
+    for (int op = 0; op < 16; op++)
+        ops[op] = (Ranked){ 0, op };
+    for (int a = 0; a < 256; a++)
+        ops[rom[a] >> 4].count += counts[a];
+    qsort(ops, 16, sizeof(Ranked), CompareRanked);
+    fprintf(out, "Opcodes:\n");
+    for (int i = 0; i < 16 && ops[i].count > 0; i++) {
+        fprintf(out, "  %s  %14llu  %5.1f%%\n", OpCodeName(ops[i].key),
+            (unsigned long long)ops[i].count, Percent(ops[i].count, total));
+    }
+
+    // A JMP back to a lower address closes a loop over everything in
+    // between. Only the last target of each JMP is known, a JMP that
+    // went to several places is reported with that one.
+    int loops = 0;
+    for (int j = 0; j < 256; j++) {
+        if (p->jumps[j] == 0 || p->jumpTarget[j] > j)
+            continue;
+        uint64_t body = 0;
+        for (int a = p->jumpTarget[j]; a <= j; a++)
+            body += counts[a];
+        ranked[loops++] = (Ranked){ body, j };
+    }
+    qsort(ranked, loops, sizeof(Ranked), CompareRanked);
+    fprintf(out, "Loops:\n");
+    for (int i = 0; i < HOT_LOOPS && i < loops; i++) {
+        int j = ranked[i].key;
+        fprintf(out, "  %02X-%02X  %12llu passes  %14llu instructions  %5.1f%%\n",
+            p->jumpTarget[j], j, (unsigned long long)p->jumps[j],
+            (unsigned long long)ranked[i].count, Percent(ranked[i].count, total));
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef PBPU_PROFILE_H
+#define PBPU_PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "libpbpu.h"
+
+// Counters SimRun and SimStep fill in while set with SetProfile.
+// Code only runs on from one address to the next except where a JMP or
+// a new run takes it elsewhere, so counting those is enough to work out
+// how often every address ran, see ProfileCounts. The JIT has no
+// counters, profiled machines run on the block cache instead.
+typedef struct Profile {
+    // Taken JMPs by the address of the JMP, and where each went last
+    uint64_t jumps[256];
+    uint8_t jumpTarget[256];
+    // Times execution came to an address by a taken JMP or the start
+    // of a run
+    uint64_t entries[256];
+    // Times a run stopped with pcPtr at an address
+    uint64_t exits[256];
+    // Instructions executed
+    uint64_t cycles;
+} Profile;
+
+// Allocate zeroed counters, NULL on failure. Pass them to SetProfile
+// to start counting.
+Profile* CreateProfile(void);
+void DestroyProfile(Profile* p);
+// How often the instruction at every address ran
+void ProfileCounts(const Profile* p, uint64_t counts[256]);
+// Print the hottest addresses, the time spent per opcode and the
+// hottest loops, found by their JMP back to a lower address. rom gives
+// the mnemonics.
+void PrintProfile(const Profile* p, const uint8_t* rom, FILE* out);
+
+#endif
@@ -0,0 +1,183 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+#include "loop.h"
+#include "rewind.h"
+#include "statefile.h"
+#include "pbpu_internal.h"
+
+// An event log is a header, the start state as a StateFile and one
+// fixed size record per event:
+//
+//   cycle  u64  cycle count when the event came in
+//   type   u8   EventType
+//          3 reserved bytes
+//   arg    u32  depends on type
+//   hash   u64  HashState right after the event
+//
+// All numbers are little-endian. The hash lets a replay notice the
+// moment it stops matching instead of only at the end.
+
+// "PBPE", version, 2 reserved bytes, rewindKb
+#define EVENT_HEADER 16
+#define EVENT_RECORD 24
+static const char eventMagic[4] = { 'P', 'B', 'P', 'E' };
+
+struct EventLog {
+    FILE* out;
+    bool failed;
+};
+
+EventLog* OpenEventLog(const char* path, const Machine* m, size_t rewindKb) {
+    EventLog* log = calloc(1, sizeof(EventLog));
+    if (log == NULL)
+        return NULL;
+    log->out = fopen(path, "wb");
+    if (log->out == NULL) {
+        free(log);
+        return NULL;
+    }
+    uint8_t header[EVENT_HEADER] = { 0 };
+    memcpy(header, eventMagic, sizeof(eventMagic));
+    PutLittle(header + 4, EVENT_LOG_VERSION, 2);
+    PutLittle(header + 8, rewindKb, 8);
+    SavedMachine start;
+    StateFile file;
+    CaptureMachine(m, &start);
+    EncodeState(&start, &file);
+    if (fwrite(header, 1, sizeof(header), log->out) != sizeof(header)
+        || fwrite(&file, 1, sizeof(file), log->out) != sizeof(file)
+        || fflush(log->out) != 0)
+        log->failed = true;
+    return log;
+}
+
+void LogEvent(EventLog* log, const Machine* m, EventType type, uint32_t arg, uint64_t cycle) {
+    uint8_t record[EVENT_RECORD] = { 0 };
+    PutLittle(record, cycle, 8);
+    record[8] = type;
+    PutLittle(record + 12, arg, 4);
+    PutLittle(record + 16, HashState(m), 8);
+    if (fwrite(record, 1, sizeof(record), log->out) != sizeof(record)
+        || fflush(log->out) != 0)
+        log->failed = true;
+}
+
+bool CloseEventLog(EventLog* log) {
+    bool ok = !log->failed;
+    if (fclose(log->out) != 0)
+        ok = false;
+    free(log);
+    return ok;
+}
+
+const char* ReplayResultName(ReplayResult result) {
+    switch (result) {
+        case REPLAY_OK:
+            return "OK";
+        case REPLAY_IO:
+            return "can't read the event log";
+        case REPLAY_FORMAT:
+            return "not an event log, cut short or from a newer version";
+        case REPLAY_DIVERGED:
+            return "diverged from the recording";
+    }
+    return "unknown";
+}
+
+// Run m up to cycle at full speed. Halts don't end anything here, the
+// recorded run only got past them because someone stepped on. reason
+// is left at why the last run stopped, ran counts the instructions.
+static bool RunTo(History* h, Machine* m, uint64_t cycle, uint64_t* ran, StopReason* reason) {
+    while (m->cycles < cycle) {
+        uint64_t before = m->cycles;
+        if (h != NULL)
+            *reason = HistoryRun(h, m, cycle - m->cycles);
+        else
+            *reason = SimRun(m, cycle - m->cycles);
+        if (m->cycles == before)
+            return false;
+        *ran += m->cycles - before;
+    }
+    return m->cycles == cycle;
+}
+
+ReplayResult ReplayEvents(Machine* m, const char* path, uint64_t* events, uint64_t* ran,
+        StopReason* reason) {
+    *events = 0;
+    *ran = 0;
+    *reason = STOP_BUDGET;
+    FILE* in = fopen(path, "rb");
+    if (in == NULL)
+        return REPLAY_IO;
+    uint8_t header[EVENT_HEADER];
+    SavedMachine start;
+    if (fread(header, 1, sizeof(header), in) != sizeof(header)
+        || memcmp(header, eventMagic, sizeof(eventMagic)) != 0
+        || GetLittle(header + 4, 2) > EVENT_LOG_VERSION
+        || ReadState(in, &start) != STATE_OK) {
+        fclose(in);
+        return REPLAY_FORMAT;
+    }
+    RestoreMachine(m, &start);
+
+    // Rewinds only come out the same with the same history behind them
+    size_t rewindKb = GetLittle(header + 8, 8);
+    History* h = NULL;
+    if (rewindKb > 0) {
+        h = CreateHistory(rewindKb * 1024);
+        if (h == NULL) {
+            fclose(in);
+            return REPLAY_IO;
+        }
+        ResetHistory(h, m);
+    }
+
+    ReplayResult result = REPLAY_OK;
+    uint8_t record[EVENT_RECORD];
+    // A log without EVENT_END is from a run that crashed, it replays up
+    // to the last whole event that made it to the file
+    while (fread(record, 1, sizeof(record), in) == sizeof(record)) {
+        uint64_t cycle = GetLittle(record, 8);
+        uint32_t arg = GetLittle(record + 12, 4);
+        if (!RunTo(h, m, cycle, ran, reason)) {
+            result = REPLAY_DIVERGED;
+            break;
+        }
+        bool applied;
+        switch (record[8]) {
+            case EVENT_REWIND:
+                applied = h != NULL && Rewind(h, m, arg);
+                // Going back leaves the machine ready to run on
+                *reason = STOP_BUDGET;
+                break;
+            case EVENT_END:
+                applied = true;
+                break;
+            default:
+                applied = false;
+                result = REPLAY_FORMAT;
+                break;
+        }
+        if (result != REPLAY_OK)
+            break;
+        if (!applied || HashState(m) != GetLittle(record + 16, 8)) {
+            result = REPLAY_DIVERGED;
+            break;
+        }
+        (*events)++;
+        if (record[8] == EVENT_END)
+            break;
+    }
+    if (result == REPLAY_OK && ferror(in))
+        result = REPLAY_IO;
+
+    if (h != NULL)
+        DestroyHistory(h);
+    fclose(in);
+    return result;
+}
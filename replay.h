@@ -0,0 +1,51 @@
+#ifndef PBPU_REPLAY_H
+#define PBPU_REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libpbpu.h"
+
+// Bumped whenever the format in replay.c changes
+#define EVENT_LOG_VERSION 1
+
+// Things from outside the program that change a run. Between them the
+// machine is deterministic, so the cycle each one came at is all the
+// timing a replay needs.
+typedef enum {
+    EVENT_REWIND = 1, // went back arg instructions, see rewind.h
+    EVENT_END = 2     // the session ended
+} EventType;
+
+// Records the events of one run
+typedef struct EventLog EventLog;
+
+// Start a log at the current state of m, NULL if path can't be created.
+// rewindKb is the history size rewinds ran with, replays use the same.
+EventLog* OpenEventLog(const char* path, const Machine* m, size_t rewindKb);
+// Append an event that arrived at cycle and left m as it is now. Each
+// event goes to the file right away, so a crash keeps the log.
+void LogEvent(EventLog* log, const Machine* m, EventType type, uint32_t arg, uint64_t cycle);
+// Close the file and free log, false if any write failed
+bool CloseEventLog(EventLog* log);
+
+// How a replay went
+typedef enum {
+    REPLAY_OK,
+    REPLAY_IO,      // the log can't be read
+    REPLAY_FORMAT,  // not an event log, cut short or from a newer version
+    REPLAY_DIVERGED // the state after an event isn't the recorded one
+} ReplayResult;
+
+// Readable description of a result
+const char* ReplayResultName(ReplayResult result);
+// Put m into the recorded start state and feed it every event at its
+// cycle, running at full speed in between. m ends where the recorded
+// run ended, or right after the event that diverged. events counts the
+// events replayed, ran the instructions run between them, reason tells
+// why the last run before the end stopped: STOP_HALT if the recording
+// ended on a halt.
+ReplayResult ReplayEvents(Machine* m, const char* path, uint64_t* events, uint64_t* ran,
+    StopReason* reason);
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind.h"
+#include "pbpu_internal.h"
+
+// Going back uses the undo log while it reaches far enough, otherwise
+// the newest checkpoint before the target plus a replay of at most
+// CHECKPOINT_CYCLES. The replay is single stepped into the undo log so
+// the next steps back are cheap again.
+
+// Registers and ram at one cycle count, the rom lives in History
+typedef struct {
+    uint64_t cycles;
+    uint8_t ram[128];
+    uint8_t pcPtr, tmpPcPtr, locPtr;
+    uint8_t regX, regY, regZ;
+    bool useCarry, carry;
+} Checkpoint;
+
+// How to undo one instruction
+typedef struct {
+    // Cycle count before it
+    uint64_t cycles;
+    uint8_t pcPtr, tmpPcPtr, locPtr;
+    // X in the low nibble, Y in the high one
+    uint8_t regXY;
+    uint8_t regZ;
+    // UNDO_ bits below
+    uint8_t flags;
+    // Nibble a ZTR overwrote and what it held
+    uint8_t addr, old;
+} UndoEntry;
+
+#define UNDO_USE_CARRY 1
+#define UNDO_CARRY 2
+#define UNDO_WROTE 4
+
+struct History {
+    uint8_t rom[256];
+    // Ring of checkpoints, one every CHECKPOINT_CYCLES, oldest first
+    Checkpoint* checkpoints;
+    size_t checkpointSize, checkpointFirst, checkpointCount;
+    // Ring of undo entries for an unbroken run of single steps that
+    // ends at the current state, oldest first
+    UndoEntry* undo;
+    size_t undoSize, undoFirst, undoCount;
+};
+
+History* CreateHistory(size_t memoryBytes) {
+    // A quarter for the undo log, the rest for checkpoints
+    size_t undoSize = memoryBytes / 4 / sizeof(UndoEntry);
+    size_t checkpointSize = (memoryBytes - undoSize * sizeof(UndoEntry)) / sizeof(Checkpoint);
+    if (undoSize < 1 || checkpointSize < 2)
+        return NULL;
+    History* h = calloc(1, sizeof(History));
+    if (h == NULL)
+        return NULL;
+    h->checkpoints = malloc(checkpointSize * sizeof(Checkpoint));
+    h->undo = malloc(undoSize * sizeof(UndoEntry));
+    if (h->checkpoints == NULL || h->undo == NULL) {
+        DestroyHistory(h);
+        return NULL;
+    }
+    h->checkpointSize = checkpointSize;
+    h->undoSize = undoSize;
+    return h;
+}
+
+void DestroyHistory(History* h) {
+    free(h->checkpoints);
+    free(h->undo);
+    free(h);
+}
+
+static Checkpoint* NthCheckpoint(History* h, size_t i) {
+    return &h->checkpoints[(h->checkpointFirst + i) % h->checkpointSize];
+}
+
+static UndoEntry* NthUndo(History* h, size_t i) {
+    return &h->undo[(h->undoFirst + i) % h->undoSize];
+}
+
+// Once a ring is full the oldest entry makes room
+static void TakeCheckpoint(History* h, const Machine* m) {
+    if (h->checkpointCount == h->checkpointSize) {
+        h->checkpointFirst = (h->checkpointFirst + 1) % h->checkpointSize;
+        h->checkpointCount--;
+    }
+    Checkpoint* c = NthCheckpoint(h, h->checkpointCount++);
+    c->cycles = m->cycles;
+    memcpy(c->ram, m->ram, sizeof(c->ram));
+    c->pcPtr = m->pcPtr;
+    c->tmpPcPtr = m->tmpPcPtr;
+    c->locPtr = m->locPtr;
+    c->regX = m->regX;
+    c->regY = m->regY;
+    c->regZ = m->regZ;
+    c->useCarry = m->useCarry;
+    c->carry = m->carry;
+}
+
+static void PushUndo(History* h, const UndoEntry* e) {
+    if (h->undoCount == h->undoSize) {
+        h->undoFirst = (h->undoFirst + 1) % h->undoSize;
+        h->undoCount--;
+    }
+    *NthUndo(h, h->undoCount++) = *e;
+}
+
+static void MaybeCheckpoint(History* h, const Machine* m) {
+    if (m->cycles >= NthCheckpoint(h, h->checkpointCount - 1)->cycles + CHECKPOINT_CYCLES)
+        TakeCheckpoint(h, m);
+}
+
+void ResetHistory(History* h, const Machine* m) {
+    memcpy(h->rom, m->rom, sizeof(h->rom));
+    h->checkpointFirst = h->checkpointCount = 0;
+    h->undoFirst = h->undoCount = 0;
+    TakeCheckpoint(h, m);
+}
+
+void HistoryStep(History* h, Machine* m) {
+    UndoEntry e = {
+        m->cycles, m->pcPtr, m->tmpPcPtr, m->locPtr,
+        m->regX | m->regY << 4, m->regZ,
+        (m->useCarry ? UNDO_USE_CARRY : 0) | (m->carry ? UNDO_CARRY : 0),
+        0, 0
+    };
+    if ((m->rom[m->pcPtr] >> 4) == OP_ZTR) {
+        e.flags |= UNDO_WROTE;
+        e.addr = m->locPtr;
+        e.old = ReadNibble(m, m->locPtr);
+    }
+    // The log only holds unbroken runs up to the current state
+    if (h->undoCount > 0 && NthUndo(h, h->undoCount - 1)->cycles + 1 != m->cycles)
+        h->undoCount = 0;
+    SimStep(m);
+    if (m->cycles == e.cycles + 1)
+        PushUndo(h, &e);
+    MaybeCheckpoint(h, m);
+}
+
+StopReason HistoryRun(History* h, Machine* m, uint64_t maxCycles) {
+    uint64_t end = m->cycles + maxCycles;
+    StopReason reason = STOP_BUDGET;
+    if (maxCycles > 0)
+        h->undoCount = 0;
+    // Chunks end right where the next checkpoint is due
+    while (m->cycles < end) {
+        uint64_t next = NthCheckpoint(h, h->checkpointCount - 1)->cycles + CHECKPOINT_CYCLES;
+        reason = SimRun(m, (next < end ? next : end) - m->cycles);
+        MaybeCheckpoint(h, m);
+        if (reason != STOP_BUDGET)
+            break;
+    }
+    return reason;
+}
+
+static void RestoreCheckpoint(History* h, Machine* m, const Checkpoint* c) {
+    MachineState state;
+    memcpy(state.rom, h->rom, sizeof(state.rom));
+    memcpy(state.ram, c->ram, sizeof(state.ram));
+    state.pcPtr = c->pcPtr;
+    state.tmpPcPtr = c->tmpPcPtr;
+    state.locPtr = c->locPtr;
+    state.regX = c->regX;
+    state.regY = c->regY;
+    state.regZ = c->regZ;
+    state.useCarry = c->useCarry;
+    state.carry = c->carry;
+    state.cycles = c->cycles;
+    SetState(m, &state);
+}
+
+static void ApplyUndo(Machine* m, const UndoEntry* e) {
+    m->cycles = e->cycles;
+    m->pcPtr = e->pcPtr;
+    m->tmpPcPtr = e->tmpPcPtr;
+    m->locPtr = e->locPtr;
+    m->regX = e->regXY & 0xF;
+    m->regY = e->regXY >> 4;
+    m->regZ = e->regZ;
+    m->useCarry = e->flags & UNDO_USE_CARRY;
+    m->carry = e->flags & UNDO_CARRY;
+    if (e->flags & UNDO_WROTE) {
+        WriteNibble(m, e->addr, e->old);
+    }
+}
+
+bool Rewind(History* h, Machine* m, uint64_t steps) {
+    if (steps > m->cycles)
+        return false;
+    uint64_t target = m->cycles - steps;
+    bool undoReaches = h->undoCount > 0
+        && NthUndo(h, h->undoCount - 1)->cycles + 1 == m->cycles
+        && NthUndo(h, 0)->cycles <= target;
+
+    // Checkpoints past the target get taken again on the way forward
+    size_t keep = h->checkpointCount;
+    while (keep > 0 && NthCheckpoint(h, keep - 1)->cycles > target)
+        keep--;
+    if (!undoReaches && keep == 0)
+        return false;
+    h->checkpointCount = keep;
+
+    if (undoReaches) {
+        while (m->cycles > target)
+            ApplyUndo(m, NthUndo(h, --h->undoCount));
+        if (keep == 0)
+            TakeCheckpoint(h, m);
+    } else {
+        RestoreCheckpoint(h, m, NthCheckpoint(h, keep - 1));
+        h->undoCount = 0;
+        // Replay what doesn't fit the undo log in one go, step the rest
+        uint64_t stepped = target - m->cycles < h->undoSize ? target - m->cycles : h->undoSize;
+        while (m->cycles < target - stepped)
+            SimRun(m, target - stepped - m->cycles);
+        while (m->cycles < target)
+            HistoryStep(h, m);
+    }
+    // The state after the last taken JMP is gone, this only holds off
+    // the next fixed point halt by one pass
+    m->storedSinceJump = true;
+    return true;
+}
@@ -0,0 +1,33 @@
+#ifndef PBPU_REWIND_H
+#define PBPU_REWIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libpbpu.h"
+
+// Cycles between two checkpoints
+#define CHECKPOINT_CYCLES 4096
+
+// Past states of one machine to go back to, see rewind.c
+typedef struct History History;
+
+// Allocate a history that never uses more than about memoryBytes,
+// NULL on failure or if that's too little to be useful
+History* CreateHistory(size_t memoryBytes);
+// Free a history from CreateHistory
+void DestroyHistory(History* h);
+// Forget everything and start over from the state m is in now. The rom
+// is taken from here, it has to stay the same afterwards.
+void ResetHistory(History* h, const Machine* m);
+
+// SimStep that remembers how to undo the instruction
+void HistoryStep(History* h, Machine* m);
+// SimRun that takes a checkpoint every CHECKPOINT_CYCLES
+StopReason HistoryRun(History* h, Machine* m, uint64_t maxCycles);
+// Take m back by steps instructions. False if the history doesn't
+// reach that far, m is left alone then.
+bool Rewind(History* h, Machine* m, uint64_t steps);
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "statefile.h"
+#include "pbpu_internal.h"
+
+_Static_assert(sizeof(StateFile) == 416, "StateFile must not have padding");
+
+static const char stateMagic[4] = { 'P', 'B', 'P', 'S' };
+
+const char* StateFileResultName(StateFileResult result) {
+    switch (result) {
+        case STATE_OK: return "ok";
+        case STATE_IO: return "file can't be accessed";
+        case STATE_FORMAT: return "not a state file";
+        case STATE_VERSION: return "state file from a newer version";
+    }
+    return "unknown";
+}
+
+void PutLittle(uint8_t* out, uint64_t val, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out[i] = val >> (8 * i);
+}
+
+uint64_t GetLittle(const uint8_t* in, int bytes) {
+    uint64_t val = 0;
+    for (int i = 0; i < bytes; i++)
+        val |= (uint64_t)in[i] << (8 * i);
+    return val;
+}
+
+void CaptureMachine(const Machine* m, SavedMachine* saved) {
+    GetState(m, &saved->state);
+    saved->lastJump = m->lastJump;
+    saved->storedSinceJump = m->storedSinceJump;
+}
+
+void RestoreMachine(Machine* m, const SavedMachine* saved) {
+    SetState(m, &saved->state);
+    m->lastJump = saved->lastJump;
+    m->lastJump.regX &= 0xF;
+    m->lastJump.regY &= 0xF;
+    m->lastJump.regZ &= 0xF;
+    m->storedSinceJump = saved->storedSinceJump;
+}
+
+void EncodeState(const SavedMachine* saved, StateFile* file) {
+    const MachineState* state = &saved->state;
+    const JumpState* jump = &saved->lastJump;
+    memset(file, 0, sizeof(*file));
+    memcpy(file->magic, stateMagic, sizeof(file->magic));
+    PutLittle((uint8_t*)&file->version, STATE_FILE_VERSION, 2);
+    PutLittle((uint8_t*)&file->size, sizeof(StateFile), 2);
+    PutLittle((uint8_t*)&file->cycles, state->cycles, 8);
+    memcpy(file->rom, state->rom, sizeof(file->rom));
+    memcpy(file->ram, state->ram, sizeof(file->ram));
+    file->pcPtr = state->pcPtr;
+    file->tmpPcPtr = state->tmpPcPtr;
+    file->locPtr = state->locPtr;
+    file->regX = state->regX;
+    file->regY = state->regY;
+    file->regZ = state->regZ;
+    file->flags = (state->useCarry ? 1 : 0) | (state->carry ? 2 : 0);
+    file->jumpPc = jump->jmpPc;
+    file->jumpTmpPcPtr = jump->tmpPcPtr;
+    file->jumpLocPtr = jump->locPtr;
+    file->jumpRegX = jump->regX;
+    file->jumpRegY = jump->regY;
+    file->jumpRegZ = jump->regZ;
+    file->jumpFlags = (jump->useCarry ? 1 : 0) | (jump->carry ? 2 : 0)
+        | (saved->storedSinceJump ? 4 : 0);
+}
+
+// Fields are read through a byte pointer, data needn't be aligned
+StateFileResult DecodeState(const void* data, size_t size, SavedMachine* saved) {
+    const uint8_t* bytes = data;
+    if (size < offsetof(StateFile, cycles) || memcmp(bytes, stateMagic, sizeof(stateMagic)) != 0)
+        return STATE_FORMAT;
+    if (GetLittle(bytes + offsetof(StateFile, version), 2) > STATE_FILE_VERSION)
+        return STATE_VERSION;
+    size_t fileSize = GetLittle(bytes + offsetof(StateFile, size), 2);
+    if (fileSize < sizeof(StateFile) || size < fileSize)
+        return STATE_FORMAT;
+    MachineState* state = &saved->state;
+    JumpState* jump = &saved->lastJump;
+#define FIELD(name) bytes[offsetof(StateFile, name)]
+    state->cycles = GetLittle(&FIELD(cycles), 8);
+    memcpy(state->rom, &FIELD(rom), sizeof(state->rom));
+    memcpy(state->ram, &FIELD(ram), sizeof(state->ram));
+    state->pcPtr = FIELD(pcPtr);
+    state->tmpPcPtr = FIELD(tmpPcPtr);
+    state->locPtr = FIELD(locPtr);
+    state->regX = FIELD(regX);
+    state->regY = FIELD(regY);
+    state->regZ = FIELD(regZ);
+    state->useCarry = FIELD(flags) & 1;
+    state->carry = (FIELD(flags) >> 1) & 1;
+    jump->jmpPc = FIELD(jumpPc);
+    jump->tmpPcPtr = FIELD(jumpTmpPcPtr);
+    jump->locPtr = FIELD(jumpLocPtr);
+    jump->regX = FIELD(jumpRegX);
+    jump->regY = FIELD(jumpRegY);
+    jump->regZ = FIELD(jumpRegZ);
+    jump->useCarry = FIELD(jumpFlags) & 1;
+    jump->carry = (FIELD(jumpFlags) >> 1) & 1;
+    saved->storedSinceJump = (FIELD(jumpFlags) >> 2) & 1;
+#undef FIELD
+    return STATE_OK;
+}
+
+StateFileResult ReadState(FILE* in, SavedMachine* saved) {
+    StateFile file;
+    size_t readBytes = fread(&file, 1, sizeof(file), in);
+    if (ferror(in))
+        return STATE_IO;
+    return DecodeState(&file, readBytes, saved);
+}
+
+StateFileResult SaveStateFile(const SavedMachine* saved, const char* path) {
+    StateFile file;
+    EncodeState(saved, &file);
+    FILE* out = fopen(path, "wb");
+    if (out == NULL)
+        return STATE_IO;
+    bool written = fwrite(&file, sizeof(file), 1, out) == 1;
+    if (fclose(out) != 0)
+        written = false;
+    return written ? STATE_OK : STATE_IO;
+}
+
+StateFileResult LoadStateFile(SavedMachine* saved, const char* path) {
+    FILE* in = fopen(path, "rb");
+    if (in == NULL)
+        return STATE_IO;
+    StateFileResult result = ReadState(in, saved);
+    fclose(in);
+    return result;
+}
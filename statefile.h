@@ -0,0 +1,87 @@
+#ifndef PBPU_STATEFILE_H
+#define PBPU_STATEFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "libpbpu.h"
+
+// Bumped whenever the layout below changes, files from newer versions
+// are refused
+#define STATE_FILE_VERSION 1
+
+// On-disk layout of a saved machine. Fields sit at fixed offsets with
+// no pointers or padding and cycles is little-endian, so a mapped file
+// can be read in place.
+typedef struct {
+    // "PBPS"
+    char magic[4];
+    // STATE_FILE_VERSION of the writer
+    uint16_t version;
+    // Bytes in the file, sizeof(StateFile) of the writer
+    uint16_t size;
+    uint64_t cycles;
+    uint8_t rom[256];
+    uint8_t ram[128];
+    uint8_t pcPtr;
+    uint8_t tmpPcPtr;
+    uint8_t locPtr;
+    uint8_t regX, regY, regZ;
+    // Bit 0 useCarry, bit 1 carry
+    uint8_t flags;
+    uint8_t reserved;
+    // Halt detection, Machine.lastJump and storedSinceJump
+    uint8_t jumpPc;
+    uint8_t jumpTmpPcPtr;
+    uint8_t jumpLocPtr;
+    uint8_t jumpRegX, jumpRegY, jumpRegZ;
+    // Bit 0 useCarry, bit 1 carry, bit 2 storedSinceJump
+    uint8_t jumpFlags;
+    uint8_t reserved2;
+} StateFile;
+
+// Everything a saved machine picks up again. Besides the architectural
+// state that is where halt detection stands, so a resumed run halts at
+// the same cycle as one that never stopped.
+typedef struct {
+    MachineState state;
+    JumpState lastJump;
+    bool storedSinceJump;
+} SavedMachine;
+
+// Why saving or loading a state failed
+typedef enum {
+    STATE_OK,
+    STATE_IO,      // the file couldn't be opened, read or written
+    STATE_FORMAT,  // not a state file, or cut short
+    STATE_VERSION  // written by a newer version
+} StateFileResult;
+
+// Multi-byte fields are stored little-endian whatever the host is, these
+// write and read the low bytes of val. Traces and event logs use them too.
+void PutLittle(uint8_t* out, uint64_t val, int bytes);
+uint64_t GetLittle(const uint8_t* in, int bytes);
+
+// Readable description of a result
+const char* StateFileResultName(StateFileResult result);
+
+// Take everything SavedMachine holds out of m
+void CaptureMachine(const Machine* m, SavedMachine* saved);
+// Put it back, SetState alone starts halt detection over
+void RestoreMachine(Machine* m, const SavedMachine* saved);
+
+// Fill in the on-disk form of saved
+void EncodeState(const SavedMachine* saved, StateFile* file);
+// Read a state from size bytes at data, e.g. a mapped file
+StateFileResult DecodeState(const void* data, size_t size, SavedMachine* saved);
+// Read a state file that starts at the current position of in, e.g.
+// inside a trace, and leave in right after it
+StateFileResult ReadState(FILE* in, SavedMachine* saved);
+
+// Write saved to path, replacing it
+StateFileResult SaveStateFile(const SavedMachine* saved, const char* path);
+// Read a state written by SaveStateFile
+StateFileResult LoadStateFile(SavedMachine* saved, const char* path);
+
+#endif
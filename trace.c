@@ -0,0 +1,366 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "statefile.h"
+#include "pbpu_internal.h"
+
+// A trace is a header followed by one record per instruction. Records
+// are nibbles, packed two per byte with the first one in the low half.
+// Each holds only what the instruction changed compared to the state
+// before it: up to three mask nibbles, each followed by the values of
+// the fields it marks.
+//
+//   M1  bit 0 Z        new Z
+//       bit 1 LOC_LO   new low nibble of locPtr
+//       bit 2 WRITE    nibble stored to ram[locPtr]
+//       bit 3          M2 follows
+//   M2  bit 0 JUMP     new pcPtr, low nibble first. Without it pcPtr
+//                      just moved on by one
+//       bit 1 X        new X
+//       bit 2 Y        new Y
+//       bit 3          M3 follows
+//   M3  bit 0 CARRY    carry flipped
+//       bit 1 USE      useCarry flipped
+//       bit 2 LOC_HI   new high nibble of locPtr
+//       bit 3 TMP      new tmpPcPtr, low nibble first
+//
+// A plain instruction costs one nibble, most others two or three.
+
+// "PBPT", version, 2 reserved bytes, instruction count, then the start
+// state as a StateFile
+#define TRACE_HEADER 16
+static const char traceMagic[4] = { 'P', 'B', 'P', 'T' };
+
+// Bytes collected before each write to the file
+#define TRACE_BUFFER (1 << 20)
+
+struct TraceWriter {
+    FILE* out;
+    uint8_t* buffer;
+    size_t used;
+    // First nibble of a byte that isn't complete yet
+    uint8_t pending;
+    bool half;
+    uint64_t count;
+    uint64_t bytes;
+    bool failed;
+};
+
+struct TraceReader {
+    FILE* in;
+    uint8_t* buffer;
+    size_t used, filled;
+    // Second nibble of the last byte read
+    uint8_t pending;
+    bool half;
+    uint64_t length;
+    uint64_t read;
+    MachineState start;
+};
+
+static void FlushTrace(TraceWriter* t) {
+    if (t->used > 0 && fwrite(t->buffer, 1, t->used, t->out) != t->used)
+        t->failed = true;
+    t->bytes += t->used;
+    t->used = 0;
+}
+
+static inline void PutNibble(TraceWriter* t, uint8_t val) {
+    if (!t->half) {
+        t->pending = val;
+        t->half = true;
+        return;
+    }
+    t->buffer[t->used++] = t->pending | val << 4;
+    t->half = false;
+    if (t->used == TRACE_BUFFER)
+        FlushTrace(t);
+}
+
+static void WriteHeader(TraceWriter* t, const SavedMachine* start) {
+    uint8_t header[TRACE_HEADER] = { 0 };
+    memcpy(header, traceMagic, sizeof(traceMagic));
+    PutLittle(header + 4, TRACE_VERSION, 2);
+    PutLittle(header + 8, t->count, 8);
+    if (fwrite(header, 1, sizeof(header), t->out) != sizeof(header))
+        t->failed = true;
+    if (start != NULL) {
+        StateFile file;
+        EncodeState(start, &file);
+        if (fwrite(&file, 1, sizeof(file), t->out) != sizeof(file))
+            t->failed = true;
+    }
+}
+
+TraceWriter* OpenTrace(const char* path, const Machine* m) {
+    TraceWriter* t = calloc(1, sizeof(TraceWriter));
+    if (t == NULL)
+        return NULL;
+    t->buffer = malloc(TRACE_BUFFER);
+    t->out = fopen(path, "wb");
+    if (t->buffer == NULL || t->out == NULL) {
+        if (t->out != NULL)
+            fclose(t->out);
+        free(t->buffer);
+        free(t);
+        return NULL;
+    }
+    SavedMachine start;
+    CaptureMachine(m, &start);
+    WriteHeader(t, &start);
+    return t;
+}
+
+StopReason TraceRun(TraceWriter* t, Machine* m, uint64_t maxCycles) {
+    StopReason reason = STOP_BUDGET;
+    for (uint64_t i = 0; i < maxCycles && reason == STOP_BUDGET; i++) {
+        uint8_t pc = m->pcPtr, tmp = m->tmpPcPtr, loc = m->locPtr;
+        uint8_t x = m->regX, y = m->regY, z = m->regZ;
+        bool useCarry = m->useCarry, carry = m->carry;
+        bool store = (m->rom[pc] >> 4) == OP_ZTR;
+        uint64_t before = m->cycles;
+        reason = SimRun(m, 1);
+        // A breakpoint stops before the instruction
+        if (m->cycles == before)
+            break;
+
+        uint8_t m1 = 0, m2 = 0, m3 = 0;
+        m1 |= m->regZ != z ? 1 : 0;
+        m1 |= (m->locPtr ^ loc) & 0x0F ? 2 : 0;
+        m1 |= store ? 4 : 0;
+        m2 |= m->pcPtr != (uint8_t)(pc + 1) ? 1 : 0;
+        m2 |= m->regX != x ? 2 : 0;
+        m2 |= m->regY != y ? 4 : 0;
+        m3 |= m->carry != carry ? 1 : 0;
+        m3 |= m->useCarry != useCarry ? 2 : 0;
+        m3 |= (m->locPtr ^ loc) & 0xF0 ? 4 : 0;
+        m3 |= m->tmpPcPtr != tmp ? 8 : 0;
+        m2 |= m3 ? 8 : 0;
+        m1 |= m2 ? 8 : 0;
+
+        PutNibble(t, m1);
+        if (m1 & 1)
+            PutNibble(t, m->regZ);
+        if (m1 & 2)
+            PutNibble(t, m->locPtr & 0xF);
+        if (m1 & 4)
+            PutNibble(t, ReadNibble(m, m->locPtr));
+        if (m1 & 8) {
+            PutNibble(t, m2);
+            if (m2 & 1) {
+                PutNibble(t, m->pcPtr & 0xF);
+                PutNibble(t, m->pcPtr >> 4);
+            }
+            if (m2 & 2)
+                PutNibble(t, m->regX);
+            if (m2 & 4)
+                PutNibble(t, m->regY);
+            if (m2 & 8) {
+                PutNibble(t, m3);
+                if (m3 & 4)
+                    PutNibble(t, m->locPtr >> 4);
+                if (m3 & 8) {
+                    PutNibble(t, m->tmpPcPtr & 0xF);
+                    PutNibble(t, m->tmpPcPtr >> 4);
+                }
+            }
+        }
+        t->count++;
+    }
+    return reason;
+}
+
+uint64_t TraceInstructions(const TraceWriter* t) {
+    return t->count;
+}
+
+uint64_t TraceBytes(const TraceWriter* t) {
+    return TRACE_HEADER + sizeof(StateFile) + t->bytes + t->used + (t->half ? 1 : 0);
+}
+
+bool CloseTrace(TraceWriter* t) {
+    // The last byte may hold only one nibble, the count says where to stop
+    if (t->half)
+        PutNibble(t, 0);
+    FlushTrace(t);
+    if (fseek(t->out, 0, SEEK_SET) != 0)
+        t->failed = true;
+    else
+        WriteHeader(t, NULL);
+    if (fclose(t->out) != 0)
+        t->failed = true;
+    bool ok = !t->failed;
+    free(t->buffer);
+    free(t);
+    return ok;
+}
+
+TraceReader* OpenTraceReader(const char* path) {
+    TraceReader* r = calloc(1, sizeof(TraceReader));
+    if (r == NULL)
+        return NULL;
+    r->buffer = malloc(TRACE_BUFFER);
+    r->in = fopen(path, "rb");
+    uint8_t header[TRACE_HEADER];
+    SavedMachine start;
+    bool ok = r->buffer != NULL && r->in != NULL
+        && fread(header, 1, sizeof(header), r->in) == sizeof(header)
+        && memcmp(header, traceMagic, sizeof(traceMagic)) == 0
+        && GetLittle(header + 4, 2) <= TRACE_VERSION
+        && ReadState(r->in, &start) == STATE_OK;
+    if (!ok) {
+        CloseTraceReader(r);
+        return NULL;
+    }
+    r->start = start.state;
+    r->length = GetLittle(header + 8, 8);
+    return r;
+}
+
+const MachineState* TraceStart(const TraceReader* r) {
+    return &r->start;
+}
+
+uint64_t TraceLength(const TraceReader* r) {
+    return r->length;
+}
+
+// Next nibble, -1 at the end of the file
+static inline int GetNibble(TraceReader* r) {
+    if (r->half) {
+        r->half = false;
+        return r->pending;
+    }
+    if (r->used == r->filled) {
+        r->filled = fread(r->buffer, 1, TRACE_BUFFER, r->in);
+        r->used = 0;
+        if (r->filled == 0)
+            return -1;
+    }
+    uint8_t byte = r->buffer[r->used++];
+    r->pending = byte >> 4;
+    r->half = true;
+    return byte & 0xF;
+}
+
+bool ReadTraceStep(TraceReader* r, TraceStep* step, MachineState* state) {
+    if (r->read == r->length)
+        return false;
+    step->cycle = state->cycles;
+    step->pc = state->pcPtr;
+    step->instruction = state->rom[state->pcPtr];
+    step->changed = 0;
+    // Values are only ever 0-15, a cut off file shows up as -1
+    int bad = 0;
+#define NEXT() ({ int nibble = GetNibble(r); bad |= nibble; nibble & 0xF; })
+    uint8_t nextPc = state->pcPtr + 1;
+    int m1 = NEXT();
+    if (m1 & 1) {
+        state->regZ = NEXT();
+        step->changed |= TRACE_Z;
+    }
+    if (m1 & 2) {
+        state->locPtr = (state->locPtr & 0xF0) | NEXT();
+        step->changed |= TRACE_LOC_LO;
+    }
+    if (m1 & 4) {
+        uint8_t val = NEXT();
+        uint8_t* byte = &state->ram[state->locPtr / 2];
+        *byte = state->locPtr % 2 ? (*byte & 0x0F) | val << 4 : (*byte & 0xF0) | val;
+        step->changed |= TRACE_WRITE;
+    }
+    if (m1 & 8) {
+        int m2 = NEXT();
+        if (m2 & 1) {
+            nextPc = NEXT();
+            nextPc |= NEXT() << 4;
+            step->changed |= TRACE_JUMP;
+        }
+        if (m2 & 2) {
+            state->regX = NEXT();
+            step->changed |= TRACE_X;
+        }
+        if (m2 & 4) {
+            state->regY = NEXT();
+            step->changed |= TRACE_Y;
+        }
+        if (m2 & 8) {
+            int m3 = NEXT();
+            if (m3 & 1) {
+                state->carry = !state->carry;
+                step->changed |= TRACE_CARRY;
+            }
+            if (m3 & 2) {
+                state->useCarry = !state->useCarry;
+                step->changed |= TRACE_USE_CARRY;
+            }
+            if (m3 & 4) {
+                state->locPtr = (state->locPtr & 0x0F) | NEXT() << 4;
+                step->changed |= TRACE_LOC_HI;
+            }
+            if (m3 & 8) {
+                state->tmpPcPtr = NEXT();
+                state->tmpPcPtr |= NEXT() << 4;
+                step->changed |= TRACE_TMP;
+            }
+        }
+    }
+#undef NEXT
+    if (bad < 0)
+        return false;
+    state->pcPtr = nextPc;
+    state->cycles++;
+    r->read++;
+    return true;
+}
+
+void CloseTraceReader(TraceReader* r) {
+    if (r->in != NULL)
+        fclose(r->in);
+    free(r->buffer);
+    free(r);
+}
+
+bool DumpTrace(const char* path, FILE* out) {
+    TraceReader* r = OpenTraceReader(path);
+    if (r == NULL)
+        return false;
+    MachineState state = *TraceStart(r);
+    fprintf(out, "Trace of %llu instructions from cycle %llu\n",
+        (unsigned long long)TraceLength(r), (unsigned long long)state.cycles);
+    TraceStep step;
+    while (ReadTraceStep(r, &step, &state)) {
+        fprintf(out, "%10llu  %02X  %s %X ", (unsigned long long)step.cycle, step.pc,
+            OpCodeName(step.instruction >> 4), step.instruction & 0xF);
+        if (step.changed & TRACE_Z)
+            fprintf(out, " Z=%X", state.regZ);
+        if (step.changed & TRACE_X)
+            fprintf(out, " X=%X", state.regX);
+        if (step.changed & TRACE_Y)
+            fprintf(out, " Y=%X", state.regY);
+        if (step.changed & TRACE_CARRY)
+            fprintf(out, " C=%d", state.carry);
+        if (step.changed & TRACE_USE_CARRY)
+            fprintf(out, " useCarry=%d", state.useCarry);
+        if (step.changed & (TRACE_LOC_LO | TRACE_LOC_HI))
+            fprintf(out, " LC=%02X", state.locPtr);
+        if (step.changed & TRACE_WRITE) {
+            uint8_t byte = state.ram[state.locPtr / 2];
+            fprintf(out, " ram[%02X]=%X", state.locPtr, state.locPtr % 2 ? byte >> 4 : byte & 0xF);
+        }
+        if (step.changed & TRACE_TMP)
+            fprintf(out, " pc=%02X", state.tmpPcPtr);
+        if (step.changed & TRACE_JUMP)
+            fprintf(out, " PC=%02X", state.pcPtr);
+        fputc('\n', out);
+    }
+    bool complete = state.cycles - TraceStart(r)->cycles == TraceLength(r);
+    if (!complete)
+        fprintf(out, "Trace is cut short!\n");
+    CloseTraceReader(r);
+    return complete;
+}
@@ -0,0 +1,71 @@
+#ifndef PBPU_TRACE_H
+#define PBPU_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "libpbpu.h"
+
+// Bumped whenever the format in trace.c changes
+#define TRACE_VERSION 1
+
+// Writes a binary trace of every instruction a machine runs
+typedef struct TraceWriter TraceWriter;
+
+// Start a trace at the current state of m, NULL if path can't be
+// created. The file has to be seekable, its header is finished last.
+TraceWriter* OpenTrace(const char* path, const Machine* m);
+// Run like SimRun, one step at a time, and append every instruction
+StopReason TraceRun(TraceWriter* t, Machine* m, uint64_t maxCycles);
+// Instructions and bytes written so far
+uint64_t TraceInstructions(const TraceWriter* t);
+uint64_t TraceBytes(const TraceWriter* t);
+// Flush, finish the header and free t. False if any write failed.
+bool CloseTrace(TraceWriter* t);
+
+// Bits of TraceStep.changed
+enum TraceChanges {
+    TRACE_Z = 1 << 0,
+    TRACE_LOC_LO = 1 << 1,  // low nibble of locPtr
+    TRACE_WRITE = 1 << 2,   // ZTR stored to ram[locPtr]
+    TRACE_JUMP = 1 << 3,    // pcPtr went somewhere other than the next address
+    TRACE_X = 1 << 4,
+    TRACE_Y = 1 << 5,
+    TRACE_CARRY = 1 << 6,
+    TRACE_USE_CARRY = 1 << 7,
+    TRACE_LOC_HI = 1 << 8,  // high nibble of locPtr
+    TRACE_TMP = 1 << 9      // tmpPcPtr
+};
+
+// One decoded instruction
+typedef struct {
+    // Cycle count before it ran
+    uint64_t cycle;
+    // Where it ran and the rom byte there
+    uint8_t pc;
+    uint8_t instruction;
+    // TraceChanges bits
+    uint16_t changed;
+} TraceStep;
+
+// Reads a trace back, the state is rebuilt from the recorded changes
+// alone without running anything
+typedef struct TraceReader TraceReader;
+
+// Open a trace file, NULL if it can't be read or isn't a trace
+TraceReader* OpenTraceReader(const char* path);
+// State the trace started from
+const MachineState* TraceStart(const TraceReader* r);
+// Instructions in the trace
+uint64_t TraceLength(const TraceReader* r);
+// Decode the next instruction, state is updated to what it left
+// behind. False at the end or if the file is cut short.
+bool ReadTraceStep(TraceReader* r, TraceStep* step, MachineState* state);
+void CloseTraceReader(TraceReader* r);
+
+// Print a trace as text, one line per instruction. False if it can't
+// be opened or is cut short.
+bool DumpTrace(const char* path, FILE* out);
+
+#endif